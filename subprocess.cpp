@@ -1,7 +1,28 @@
 #include "subprocess.h"
 #include <sys/wait.h>
 #include <cstring>
+#include <utility>
+#include <csignal>
 #include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <linux/close_range.h>
+#include <linux/ioprio.h>
+#include <linux/sched.h>
+#include <alloca.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <climits>
+#include <string_view>
+#include <unordered_set>
+#include <algorithm>
 #include <unistd.h>
 #include <system_error>
 
@@ -15,6 +36,36 @@ subprocess operator|(const subprocess &lhs, const subprocess &rhs)
     return subprocess(new Pipe(lhs, rhs));
 }
 
+subprocess pipe(const subprocess &lhs, const subprocess &rhs, const PipeOptions &options)
+{
+    return subprocess(new Pipe(lhs, rhs, options));
+}
+
+subprocess pipe_err(const subprocess &lhs, const subprocess &rhs)
+{
+    return subprocess(new ErrPipe(lhs, rhs));
+}
+
+subprocess merge_err(const subprocess &sub)
+{
+    return subprocess(new MergeErr(sub));
+}
+
+subprocess fanout(const vector<subprocess> &outputs)
+{
+    return subprocess(new Fanout(outputs));
+}
+
+subprocess cached(const subprocess &sub, Stats::clock::duration ttl, const vector<string> &files)
+{
+    return subprocess(new Cached(sub, ttl, files, std::make_shared<Cached::Cache>()));
+}
+
+subprocess profile(const subprocess &sub, const LaunchOptions &options)
+{
+    return subprocess(new Profiled(sub, options));
+}
+
 subprocess operator||(const subprocess &lhs, const subprocess &rhs)
 {
     return subprocess(new Or(lhs, rhs));
@@ -27,7 +78,11 @@ subprocess operator&&(const subprocess &lhs, const subprocess &rhs)
 
 int run(const subprocess &subprocess, Environment &env)
 {
-    return subprocess->start({}, env)->wait();
+    Stats stats{};
+    int ret = subprocess->execute(env, stats);
+    if (env.tracer)
+        env.tracer->trace(stats);
+    return ret;
 }
 
 int run(const script &scr, Environment &env)
@@ -43,7 +98,11 @@ int run(const script &scr, Environment &env)
 
 int run(const subprocess &subprocess, const Environment &env)
 {
-    return subprocess->start({}, env)->wait();
+    Stats stats{};
+    int ret = subprocess->execute(env, stats);
+    if (env.tracer)
+        env.tracer->trace(stats);
+    return ret;
 }
 
 int run(const script &scr, const Environment &env)
@@ -57,32 +116,440 @@ int run(const script &scr, const Environment &env)
     return 0;
 }
 
+int run(const subprocess &subprocess, Environment &env, Cancellation &cancellation)
+{
+    RunArena arena{};
+    runsubprocess running = subprocess->start({}, env);
+    cancellation.add(running.get());
+    int ret = running->wait();
+    cancellation.remove(running.get());
+    if (env.tracer)
+        env.tracer->trace(running->stats());
+    return ret;
+}
+
+int run(const subprocess &subprocess, const Environment &env, Cancellation &cancellation)
+{
+    RunArena arena{};
+    runsubprocess running = subprocess->start({}, env);
+    cancellation.add(running.get());
+    int ret = running->wait();
+    cancellation.remove(running.get());
+    if (env.tracer)
+        env.tracer->trace(running->stats());
+    return ret;
+}
+
+int run(const script &scr, Environment &env, Cancellation &cancellation)
+{
+    for (const subprocess &sub : scr)
+    {
+        if (cancellation.cancelled())
+            return ECANCELED;
+        int r = run(sub, env, cancellation);
+        if (r != 0)
+            return r;
+    }
+    return 0;
+}
+
+int run(const script &scr, const Environment &env, Cancellation &cancellation)
+{
+    for (const subprocess &sub : scr)
+    {
+        if (cancellation.cancelled())
+            return ECANCELED;
+        int r = run(sub, env, cancellation);
+        if (r != 0)
+            return r;
+    }
+    return 0;
+}
+
+int run(const script &scr, Environment &env, const ParallelOptions &options)
+{
+    return Environment::run_parallel(scr, env, options);
+}
+
+int run(const script &scr, const Environment &env, const ParallelOptions &options)
+{
+    return Environment::run_parallel(scr, env, options);
+}
+
 Environment::Environment(char **list) :
-    env{}
+    vars(std::make_shared<Vars>()),
+    launcher(&Launcher::PosixSpawn),
+    executor(&Executor::Threads),
+    pipe_options{},
+    launch_options{},
+    tracer(nullptr),
+    generation(0),
+    envp_cache{},
+    envp_generation(0)
 {
     for (size_t i = 0; list[i]; i++)
     {
         const char *del = strchr(list[i], '=');
-        env.emplace(string(list[i], del - list[i]), std::pair<string, bool>(string(del + 1), true));
+        vars->own.emplace(string(list[i], del - list[i]), Var(string(del + 1), true));
     }
 };
 
 Environment::Environment(const Environment &env) :
-    env(env.env)
+    launcher(env.launcher),
+    executor(env.executor),
+    pipe_options(env.pipe_options),
+    launch_options(env.launch_options),
+    tracer(env.tracer),
+    generation(env.generation.load())
+{
+    // The copy has the same variables, so it can share them and the cached envp
+    std::lock_guard<std::mutex> lock(env.mutex);
+    vars = env.vars;
+    envp_cache = env.envp_cache;
+    envp_generation = env.envp_generation;
+}
+
+Environment &Environment::operator=(const Environment &other)
+{
+    if (this != &other)
+    {
+        std::scoped_lock lock(mutex, other.mutex);
+        vars = other.vars;
+        launcher = other.launcher;
+        executor = other.executor;
+        pipe_options = other.pipe_options;
+        launch_options = other.launch_options;
+        tracer = other.tracer;
+        envp_cache = other.envp_cache;
+        envp_generation = other.envp_generation;
+        generation = other.generation.load();
+    }
+    return *this;
+}
+
+size_t Environment::Vars::Hash::operator()(std::string_view name) const
+{
+    return std::hash<std::string_view>{}(name);
+}
+
+const Environment::Var *Environment::Vars::find(std::string_view name) const
+{
+    for (const Vars *layer = this; layer; layer = layer->parent.get())
+    {
+        auto it = layer->own.find(name);
+        if (it != layer->own.end())
+            return &it->second;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const Environment::Vars> Environment::snapshot() const
+{
+    // Holding the layer makes it shared, so set() won't change it anymore
+    std::lock_guard<std::mutex> lock(mutex);
+    return vars;
+}
+
+void Environment::set(const string &name, string &&value)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const Var *old = vars->find(name);
+    Var var(std::move(value), old && old->second);
+
+    if (vars.use_count() > 1)
+    {
+        // Someone else sees this layer, put the change on top of it
+        auto layer = std::make_shared<Vars>();
+        if (vars->depth + 1 < max_depth)
+        {
+            layer->parent = vars;
+            layer->depth = vars->depth + 1;
+        }
+        else
+        {
+            // Too many layers make every lookup slow, merge them
+            for (const Vars *l = vars.get(); l; l = l->parent.get())
+                for (auto const &el : l->own)
+                    layer->own.emplace(el.first, el.second);
+        }
+        vars = std::move(layer);
+    }
+    vars->own.insert_or_assign(name, std::move(var));
+    generation++;
+}
+
+template <typename E>
+int Environment::run_parallel(const script &scr, E &env, const ParallelOptions &options)
+{
+    size_t n = scr.size();
+
+    // Which variables are exported is checked once, when the run starts
+    std::shared_ptr<const Vars> vars = env.snapshot();
+    auto exported = [&vars](const string &name) {
+        const Var *var = vars->find(name);
+        return var && var->second;
+    };
+
+    vector<Variables> uses(n);
+    for (size_t i = 0; i < n; i++)
+        scr[i]->get_variables(uses[i]);
+
+    auto intersects = [](const vector<string> &a, const vector<string> &b) {
+        for (const string &name : a)
+            if (std::find(b.begin(), b.end(), name) != b.end())
+                return true;
+        return false;
+    };
+    auto exports = [&exported](const Variables &starts, const Variables &sets) {
+        return starts.exports && std::any_of(sets.writes.begin(), sets.writes.end(), exported);
+    };
+
+    // blocked[i] counts the unfinished steps i waits for, next[i] the ones waiting for i
+    vector<size_t> blocked(n, 0);
+    vector<vector<size_t>> next(n);
+    auto depend = [&](size_t step, size_t on) {
+        if (std::find(next[on].begin(), next[on].end(), step) == next[on].end())
+        {
+            next[on].push_back(step);
+            blocked[step]++;
+        }
+    };
+    for (size_t j = 0; j < n; j++)
+    {
+        for (size_t i = 0; i < j; i++)
+        {
+            const Variables &a = uses[i];
+            const Variables &b = uses[j];
+            if (intersects(a.writes, b.reads) || intersects(a.writes, b.writes) ||
+                intersects(a.reads, b.writes) || exports(a, b) || exports(b, a))
+                depend(j, i);
+        }
+    }
+    for (auto const &[step, on] : options.after)
+    {
+        if (step >= n || on >= n || step == on)
+            throw std::invalid_argument("Invalid script step dependency");
+        depend(step, on);
+    }
+
+    // Every step has to be reachable, otherwise the explicit ones made a cycle
+    {
+        vector<size_t> left = blocked;
+        vector<size_t> order;
+        for (size_t i = 0; i < n; i++)
+            if (left[i] == 0)
+                order.push_back(i);
+        for (size_t k = 0; k < order.size(); k++)
+            for (size_t step : next[order[k]])
+                if (--left[step] == 0)
+                    order.push_back(step);
+        if (order.size() != n)
+            throw std::invalid_argument("Cyclic script step dependencies");
+    }
+
+    // Finished steps are handed back to this thread
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::pair<size_t, int>> finished;
+    };
+    auto state = std::make_shared<State>();
+
+    std::deque<size_t> ready;
+    for (size_t i = 0; i < n; i++)
+        if (blocked[i] == 0)
+            ready.push_back(i);
+
+    size_t jobs = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+    size_t running = 0;
+    int ret = 0;
+    std::exception_ptr error;
+
+    RunArena arena{};
+    vector<runsubprocess> runs(n);
+
+    while (true)
+    {
+        bool stop = error || (ret != 0 && !options.keep_going);
+        while (!stop && !ready.empty() && running < jobs)
+        {
+            size_t i = ready.front();
+            ready.pop_front();
+            try
+            {
+                runs[i] = scr[i]->start({}, env);
+            }
+            catch (...)
+            {
+                // The running steps refer to env, so they are waited for before this is rethrown
+                error = std::current_exception();
+                break;
+            }
+            running++;
+            runs[i]->on_exit(*env.executor, [state, i](int code) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.emplace_back(i, code);
+                state->cv.notify_one();
+            });
+        }
+        if (running == 0)
+            break;
+
+        std::deque<std::pair<size_t, int>> finished;
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->cv.wait(lock, [&state] { return !state->finished.empty(); });
+            finished.swap(state->finished);
+        }
+        for (auto const &[i, code] : finished)
+        {
+            running--;
+            if (env.tracer)
+                env.tracer->trace(runs[i]->stats());
+            runs[i].reset();
+
+            // The steps depending on a failed one never become ready
+            if (code != 0)
+            {
+                if (ret == 0)
+                    ret = code;
+                continue;
+            }
+            for (size_t k : next[i])
+                if (--blocked[k] == 0)
+                    ready.push_back(k);
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+    return ret;
+}
+
+void Environment::set_launcher(const Launcher &l)
+{
+    launcher = &l;
+}
+
+void Environment::set_executor(Executor &e)
+{
+    executor = &e;
+}
+
+void Environment::set_pipe_options(const PipeOptions &options)
+{
+    pipe_options = options;
+}
+
+// The CPUs in a list like 0-3,8,10-11 as in /sys/devices/system/node/node0/cpulist
+static vector<int> parse_cpu_list(const string &list)
+{
+    vector<int> cpus{};
+    for (size_t pos = 0; pos < list.size();)
+    {
+        size_t end = list.find(',', pos);
+        if (end == string::npos)
+            end = list.size();
+        string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        int first = std::stoi(range);
+        int last = dash == string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+LaunchOptions Environment::checked(const LaunchOptions &options)
 {
+    LaunchOptions result = options;
+    for (int fd : options.keep_fds)
+    {
+        if (fd <= STDERR_FILENO)
+            throw std::invalid_argument("Kept fds start at 3, the standard streams are set up by the pipes");
+    }
+    for (int cpu : options.cpus)
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            throw std::invalid_argument("No such CPU " + std::to_string(cpu));
+    }
+    if (options.io_class < 0 || options.io_class > 3 || options.io_level < 0 || options.io_level > 7)
+        throw std::invalid_argument("I/O classes are 0 to 3 with levels 0 to 7");
+
+    // The node is read once here, the children only get a CPU mask
+    if (options.numa_node >= 0)
+    {
+        string list{};
+        int fd = ::open(("/sys/devices/system/node/node" + std::to_string(options.numa_node) + "/cpulist").c_str(),
+                        O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::invalid_argument("No such NUMA node " + std::to_string(options.numa_node));
+        char buffer[4096];
+        ssize_t count;
+        while ((count = ::read(fd, buffer, sizeof(buffer))) > 0)
+            list.append(buffer, count);
+        close(fd);
+        while (!list.empty() && isspace(static_cast<unsigned char>(list.back())))
+            list.pop_back();
+
+        vector<int> node = parse_cpu_list(list);
+        if (!options.cpus.empty())
+            std::erase_if(node, [&](int cpu) {
+                return std::find(options.cpus.begin(), options.cpus.end(), cpu) == options.cpus.end();
+            });
+        if (node.empty())
+            throw std::invalid_argument("No CPU of NUMA node " + std::to_string(options.numa_node) + " is allowed");
+        result.cpus = std::move(node);
+        result.numa_node = -1;
+    }
+    return result;
+}
+
+void Environment::set_launch_options(const LaunchOptions &options)
+{
+    launch_options = checked(options);
 }
 
-vector<const char *> Environment::envp() const
+void Environment::set_tracer(Tracer &t)
 {
-    vector<const char *> out{};
-    for (auto const &el : env)
+    tracer = &t;
+}
+
+std::shared_ptr<const Environment::Envp> Environment::envp() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    uint64_t gen = generation;
+    if (envp_cache && envp_generation == gen)
+        return envp_cache;
+    std::shared_ptr<const Vars> top = vars;
+    lock.unlock();
+
+    // Upper layers hide the same names below them
+    auto out = std::make_shared<Envp>();
+    std::unordered_set<std::string_view, Vars::Hash> seen;
+    for (const Vars *layer = top.get(); layer; layer = layer->parent.get())
     {
-        if (el.second.second)
+        for (auto const &el : layer->own)
         {
-            out.push_back(el.second.first.c_str());
+            if (seen.insert(el.first).second && el.second.second)
+                out->vars.push_back(el.first + '=' + el.second.first);
         }
     }
-    out.push_back(nullptr);
+    out->ptrs.reserve(out->vars.size() + 1);
+    for (auto &var : out->vars)
+        out->ptrs.push_back(var.data());
+    out->ptrs.push_back(nullptr);
+
+    lock.lock();
+    if (generation == gen)
+    {
+        envp_cache = out;
+        envp_generation = gen;
+    }
     return out;
 }
 
@@ -93,7 +560,27 @@ GettableVariable::GettableVariable(const string &name) :
 
 string GettableVariable::get(const Environment &env) const
 {
-    return env.env.at(name).first;
+    std::shared_ptr<const Environment::Vars> vars = env.snapshot();
+    const Environment::Var *var = vars->find(name);
+    if (!var)
+        throw std::out_of_range(name);
+    return var->first;
+}
+
+void GettableVariable::pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
+{
+    // A layer that's held is never changed, so the value stays where it is
+    std::shared_ptr<const Environment::Vars> vars = env.snapshot();
+    const Environment::Var *var = vars->find(name);
+    if (!var)
+        throw std::out_of_range(name);
+    out.push_back(var->first);
+    hold.push_back(std::move(vars));
+}
+
+void GettableVariable::get_variables(vector<string> &names) const
+{
+    names.push_back(name);
 }
 
 int Environment::run(const subprocess &sub)
@@ -116,6 +603,16 @@ int Environment::run(const script &sub) const
     return ::subprocess::run(sub, *this);
 }
 
+int Environment::run(const script &sub, const ParallelOptions &options)
+{
+    return ::subprocess::run(sub, *this, options);
+}
+
+int Environment::run(const script &sub, const ParallelOptions &options) const
+{
+    return ::subprocess::run(sub, *this, options);
+}
+
 const Environment Environment::global{environ};
 
 gettable Gettable::make_gettable(const string &value)
@@ -128,6 +625,88 @@ gettable Gettable::make_gettable(const GettableVariable &var)
     return gettable(new GettableVariable(var));
 }
 
+gettable Gettable::make_gettable(const Interpolation &interpolation)
+{
+    return gettable(new GettableConcat(interpolation.parts));
+}
+
+void Gettable::pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
+{
+    auto value = std::make_shared<const string>(get(env));
+    out.push_back(*value);
+    hold.push_back(std::move(value));
+}
+
+Interpolation operator+(const string &lhs, const GettableVariable &rhs)
+{
+    return {{Gettable::make_gettable(lhs), Gettable::make_gettable(rhs)}};
+}
+
+Interpolation operator+(const GettableVariable &lhs, const string &rhs)
+{
+    return {{Gettable::make_gettable(lhs), Gettable::make_gettable(rhs)}};
+}
+
+Interpolation operator+(const GettableVariable &lhs, const GettableVariable &rhs)
+{
+    return {{Gettable::make_gettable(lhs), Gettable::make_gettable(rhs)}};
+}
+
+Interpolation operator+(Interpolation lhs, const string &rhs)
+{
+    lhs.parts.push_back(Gettable::make_gettable(rhs));
+    return lhs;
+}
+
+Interpolation operator+(Interpolation lhs, const GettableVariable &rhs)
+{
+    lhs.parts.push_back(Gettable::make_gettable(rhs));
+    return lhs;
+}
+
+GettableConcat::GettableConcat(const vector<gettable> &parts) :
+    parts(parts)
+{
+}
+
+// The pieces copied into one string, allocated once
+static string join_pieces(const vector<std::string_view> &segs)
+{
+    size_t size = 0;
+    for (std::string_view seg : segs)
+        size += seg.size();
+    string out;
+    out.reserve(size);
+    for (std::string_view seg : segs)
+        out.append(seg);
+    return out;
+}
+
+string GettableConcat::get(const Environment &env) const
+{
+    vector<std::string_view> segs;
+    holder hold;
+    pieces(env, segs, hold);
+    return join_pieces(segs);
+}
+
+void GettableConcat::pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
+{
+    for (const gettable &part : parts)
+        part->pieces(env, out, hold);
+}
+
+bool GettableConcat::is_constant() const
+{
+    return std::all_of(parts.begin(), parts.end(), [](const gettable &part) { return part->is_constant(); });
+}
+
+void GettableConcat::get_variables(vector<string> &names) const
+{
+    for (const gettable &part : parts)
+        part->get_variables(names);
+}
+
 subprocess read(const string &name)
 {
     return subprocess(new Read(name));
@@ -142,328 +721,3964 @@ string GettableString::get(const Environment &env) const
     return value;
 }
 
-runsubprocess Subprocess::start() const
+void GettableString::pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
 {
-    return this->start({});
+    out.push_back(value);
+    hold.push_back(shared_from_this());
 }
 
-runsubprocess Subprocess::start(Streams str, Environment &env) const
+bool Gettable::is_constant() const
 {
-    return start(str, const_cast<const Environment &>(env));
+    return false;
 }
 
-StreamFlags Subprocess::get_flags() const
+void Gettable::get_variables(vector<string> &names) const
+{
+}
+
+bool GettableString::is_constant() const
+{
+    return true;
+}
+
+thread_local std::pmr::memory_resource *RunArena::active = nullptr;
+
+RunArena::RunArena(std::pmr::memory_resource *upstream) :
+    resource(buffer, sizeof(buffer), upstream),
+    previous(active)
+{
+    active = &resource;
+}
+
+RunArena::~RunArena()
+{
+    active = previous;
+}
+
+std::pmr::memory_resource *RunArena::current()
+{
+    return active ? active : std::pmr::get_default_resource();
+}
+
+// Room in front of every RunSubprocess for the resource it came from
+static const size_t run_header = alignof(std::max_align_t);
+
+void *RunSubprocess::operator new(size_t size)
+{
+    std::pmr::memory_resource *resource = RunArena::current();
+    char *ptr = static_cast<char *>(resource->allocate(size + run_header, alignof(std::max_align_t)));
+    *reinterpret_cast<std::pmr::memory_resource **>(ptr) = resource;
+    return ptr + run_header;
+}
+
+void RunSubprocess::operator delete(void *ptr, size_t size)
+{
+    char *start = static_cast<char *>(ptr) - run_header;
+    std::pmr::memory_resource *resource = *reinterpret_cast<std::pmr::memory_resource **>(start);
+    resource->deallocate(start, size + run_header, alignof(std::max_align_t));
+}
+
+void RunSubprocess::on_exit(Executor &executor, std::function<void(int)> &&done)
+{
+    executor.execute([this, done = std::move(done)]() { done(wait()); });
+}
+
+Stats RunSubprocess::stats() const
 {
     return {};
 }
 
-Pipe::Pipe(const subprocess &lhs, const subprocess &rhs) :
-    lhs(lhs->copy()),
-    rhs(rhs->copy())
+void RunSubprocess::cancel(int sig)
 {
 }
 
-subprocess Pipe::copy() const
+void Stats::add(Stats &&child)
 {
-    return subprocess(new Pipe(lhs, rhs));
+    user += child.user;
+    system += child.system;
+    max_rss = std::max(max_rss, child.max_rss);
+    bytes += child.bytes;
+    if (!signal)
+        signal = child.signal;
+    children.push_back(std::move(child));
+}
+
+ExitAwaitable RunSubprocess::async_wait(Executor &executor)
+{
+    return ExitAwaitable(*this, executor);
+}
+
+ExitAwaitable::ExitAwaitable(RunSubprocess &sub, Executor &executor) :
+    sub(sub),
+    executor(executor),
+    ret(0)
+{
+}
+
+bool ExitAwaitable::await_ready() const noexcept
+{
+    return false;
+}
+
+void ExitAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+    // The callback may run right away, nothing can be touched after on_exit()
+    sub.on_exit(executor, [this, handle](int code) {
+        ret = code;
+        handle.resume();
+    });
+}
+
+int ExitAwaitable::await_resume() const noexcept
+{
+    return ret;
+}
+
+ReadAwaitable async_read(Executor &executor, int fd, size_t max)
+{
+    return ReadAwaitable(executor, fd, max);
+}
+
+ReadAwaitable::ReadAwaitable(Executor &executor, int fd, size_t max) :
+    executor(executor),
+    fd(fd),
+    max(max),
+    data{},
+    err(0)
+{
+}
+
+bool ReadAwaitable::await_ready() const noexcept
+{
+    return false;
+}
+
+void ReadAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+    // The executor closes the fd it watches, so it gets a duplicate
+    int watched = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (watched < 0)
+    {
+        err = errno;
+        handle.resume();
+        return;
+    }
+
+    // A read shorter than a packet drops the rest of it, so a packet pipe gets whole ones
+    size_t size = max;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT))
+        size = std::max(max, size_t(PIPE_BUF));
+
+    executor.watch(watched, Executor::Readable, [this, handle, watched, size]() {
+        data.resize(size);
+        ssize_t count = ::read(watched, data.data(), size);
+        if (count < 0 && errno == EAGAIN)
+            return false;
+
+        if (count < 0)
+        {
+            err = errno;
+            count = 0;
+        }
+        data.resize(count);
+        handle.resume();
+        return true;
+    });
+}
+
+string ReadAwaitable::await_resume()
+{
+    if (err)
+        throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+    return std::move(data);
+}
+
+runsubprocess Subprocess::start() const
+{
+    return this->start({});
+}
+
+runsubprocess Subprocess::start(Streams str, Environment &env) const
+{
+    return start(str, const_cast<const Environment &>(env));
+}
+
+void Subprocess::get_variables(Variables &vars) const
+{
+}
+
+StreamFlags Subprocess::get_flags() const
+{
+    return {};
+}
+
+bool Subprocess::has_output(bool input) const
+{
+    return false;
+}
+
+string Subprocess::get_output(const Environment &env, const string *in) const
+{
+    throw std::logic_error("The output isn't known without running it");
+}
+
+void Subprocess::output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
+{
+    auto output = std::make_shared<const string>(get_output(env, nullptr));
+    out.push_back(*output);
+    hold.push_back(std::move(output));
+}
+
+bool Subprocess::takes_input() const
+{
+    return false;
+}
+
+runsubprocess Subprocess::start_with(string &&in, Streams str, const Environment &env) const
+{
+    throw std::logic_error("It needs a stdin");
+}
+
+runsubprocess Subprocess::start_with(string &&in, Streams str, Environment &env) const
+{
+    return start_with(std::move(in), str, const_cast<const Environment &>(env));
+}
+
+int Subprocess::execute(const Environment &env, Stats &stats) const
+{
+    RunArena arena{};
+    runsubprocess running = start({}, env);
+    int ret = running->wait();
+    if (env.tracer)
+        stats = running->stats();
+    return ret;
+}
+
+int Subprocess::execute(Environment &env, Stats &stats) const
+{
+    RunArena arena{};
+    runsubprocess running = start({}, env);
+    int ret = running->wait();
+    if (env.tracer)
+        stats = running->stats();
+    return ret;
+}
+
+// The fds given in str duplicated, for one of several copies started with it, as every start consumes them
+static Streams shared_streams(Streams str)
+{
+    for (int *fd : {&str.in, &str.out, &str.err})
+    {
+        if (*fd >= 0 && (*fd = fcntl(*fd, F_DUPFD_CLOEXEC, 0)) < 0)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+    }
+    return str;
+}
+
+// Kills the copies start_many() started before it failed, closing the pipes they got for str
+static void abandon(vector<runsubprocess> &runs, Streams str)
+{
+    for (runsubprocess &running : runs)
+    {
+        Streams got = running->get_streams();
+        if (str.in == Streams::New)
+            close(got.in);
+        if (str.out == Streams::New)
+            close(got.out);
+        if (str.err == Streams::New)
+            close(got.err);
+        running->cancel(SIGKILL);
+        running->wait();
+    }
+    runs.clear();
+}
+
+vector<runsubprocess> Subprocess::start_many(size_t n, Streams str, const Environment &env) const
+{
+    vector<runsubprocess> runs;
+    runs.reserve(n);
+    try
+    {
+        // The last copy gets the fds given in str themselves
+        for (size_t i = 0; i < n; i++)
+            runs.push_back(start(i + 1 < n ? shared_streams(str) : str, env));
+    }
+    catch (...)
+    {
+        abandon(runs, str);
+        throw;
+    }
+    return runs;
+}
+
+Pipe::Pipe(const subprocess &lhs, const subprocess &rhs, const std::optional<PipeOptions> &options) :
+    options(options),
+    lhs(lhs),
+    rhs(rhs)
+{
+}
+
+void Pipe::get_variables(Variables &vars) const
+{
+    lhs->get_variables(vars);
+    rhs->get_variables(vars);
+}
+
+bool Pipe::has_output(bool input) const
+{
+    // Given settings ask for a kernel pipe
+    return !options && lhs->has_output(input) && rhs->has_output(true);
+}
+
+string Pipe::get_output(const Environment &env, const string *in) const
+{
+    string middle = lhs->get_output(env, in);
+    return rhs->get_output(env, &middle);
+}
+
+subprocess Pipe::copy() const
+{
+    return subprocess(new Pipe(lhs, rhs, options));
+}
+
+void Pipe::create(int fds[2], const PipeOptions &options)
+{
+    if (::pipe2(fds, O_CLOEXEC | (options.packet ? O_DIRECT : 0)))
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+    try
+    {
+        resize(fds[0], options);
+    }
+    catch (...)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+}
+
+void Pipe::resize(int fd, const PipeOptions &options)
+{
+    if (options.capacity && fcntl(fd, F_SETPIPE_SZ, static_cast<int>(options.capacity)) < 0)
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+}
+
+StreamFlags Pipe::get_flags() const
+{
+    return {.in = lhs->get_flags().in, .out = rhs->get_flags().out, .err = rhs->get_flags().err};
+}
+
+runsubprocess Pipe::start(Streams str, const Environment &env) const
+{
+    return start<const Environment &>(str, env);
+}
+
+runsubprocess Pipe::start(Streams str, Environment &env) const
+{
+    return start<Environment &>(str, env);
+}
+
+// Set once ignore_sigpipe() made this process ignore SIGPIPE, the children then get the default back
+static std::atomic<bool> sigpipe_ignored{false};
+
+// A builtin writing to a pipe nobody reads anymore, e.g. into head(), has to get EPIPE,
+// the SIGPIPE would kill the whole process, blocking it on one thread just moves it to another
+// So, as Python does, a default SIGPIPE is ignored in the process and restored in its children
+static void ignore_sigpipe()
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction sa;
+        if (sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL)
+        {
+            sa.sa_handler = SIG_IGN;
+            sigaction(SIGPIPE, &sa, nullptr);
+            sigpipe_ignored = true;
+        }
+    });
+}
+
+// In a child before exec, async-signal-safe
+static void restore_sigpipe()
+{
+    if (sigpipe_ignored.load(std::memory_order_relaxed))
+        signal(SIGPIPE, SIG_DFL);
+}
+
+// Copies through a userspace buffer, returns 0 or errno
+static int copy_fd(int in, int out, size_t &bytes)
+{
+    const size_t bufsz = 64 * 1024;
+    std::unique_ptr<char[]> buffer(new char[bufsz]);
+    while (true)
+    {
+        ssize_t count = ::read(in, buffer.get(), bufsz);
+        if (count < 0)
+            return errno;
+        else if (count == 0)
+            return 0;
+
+        for (ssize_t done = 0; done < count;)
+        {
+            ssize_t ret = ::write(out, buffer.get() + done, count - done);
+            if (ret < 0)
+                return errno;
+            done += ret;
+        }
+        bytes += count;
+    }
+}
+
+// Moves all data from in to out without passing it through userspace where the kernel allows it,
+// copy_file_range between regular files, splice if either side is a pipe, returns 0 or errno
+static int transfer_fd(int in, int out, size_t &bytes)
+{
+    const size_t chunk = 1 << 30;
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) || fstat(out, &out_st))
+        return errno;
+
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    {
+        ssize_t count;
+        while ((count = copy_file_range(in, nullptr, out, nullptr, chunk, 0)) > 0)
+            bytes += count;
+        if (count == 0)
+            return 0;
+        // Not supported for these files (across filesystems, O_APPEND), the offsets are still valid
+        if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP)
+            return errno;
+    }
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    {
+        ssize_t count;
+        while ((count = splice(in, nullptr, out, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+            bytes += count;
+        if (count == 0)
+            return 0;
+        // splice refuses some files, e.g. ones opened with O_APPEND
+        if (errno != EINVAL)
+            return errno;
+    }
+
+    return copy_fd(in, out, bytes);
+}
+
+runsubprocess Pipe::transfer(const Environment &env, int in, int out)
+{
+    ignore_sigpipe();
+    return runsubprocess(new RunThread(
+        env,
+        "transfer",
+        [in, out](RunThread &, Stats &stats) {
+            stats.ret = transfer_fd(in, out, stats.bytes);
+            close(in);
+            close(out);
+        },
+        {.in = in, .out = out}
+    ));
+}
+
+runsubprocess Pipe::write(const Environment &env, string &&data, int out)
+{
+    auto hold = std::make_shared<const string>(std::move(data));
+    return write(env, {std::string_view(*hold)}, {hold}, out);
+}
+
+runsubprocess Pipe::write(const Environment &env, vector<std::string_view> &&segs, holder &&hold, int out)
+{
+    // It stands for the builtins that made the data, which echo it
+    return Memory::write({.out = out}, env, std::move(segs), std::move(hold), "echo");
+}
+
+RunPipe::RunPipe(runsubprocess &&lhs, runsubprocess &&rhs) :
+    lhs(std::move(lhs)),
+    rhs(std::move(rhs)),
+    streams{.in = this->lhs->get_streams().in, .out = this->rhs->get_streams().out,
+            .err = this->rhs->get_streams().err},
+    name("|")
+{
+}
+
+RunPipe::RunPipe(runsubprocess &&lhs, runsubprocess &&rhs, Streams streams, const char *name) :
+    lhs(std::move(lhs)),
+    rhs(std::move(rhs)),
+    streams(streams),
+    name(name)
+{
+}
+
+void RunPipe::cancel(int sig)
+{
+    lhs->cancel(sig);
+    rhs->cancel(sig);
+}
+
+void RunPipe::on_exit(Executor &executor, std::function<void(int)> &&done)
+{
+    struct State
+    {
+        std::atomic<int> left{2};
+        std::atomic<int> ret{0};
+        std::function<void(int)> done;
+    };
+    auto state = std::make_shared<State>();
+    state->done = std::move(done);
+
+    auto part = [state](int ret) {
+        state->ret |= ret;
+        if (--state->left == 0)
+            state->done(state->ret);
+    };
+    lhs->on_exit(executor, part);
+    rhs->on_exit(executor, part);
+}
+
+Streams RunPipe::get_streams() const
+{
+    return streams;
+}
+
+int RunPipe::wait()
+{
+    return lhs->wait() | rhs->wait();
+}
+
+Stats RunPipe::stats() const
+{
+    Stats stats{.name = name};
+    stats.add(lhs->stats());
+    stats.add(rhs->stats());
+
+    stats.begin = std::min(stats.children[0].begin, stats.children[1].begin);
+    Stats::clock::time_point end{};
+    for (const Stats &part : stats.children)
+    {
+        stats.ret |= part.ret;
+        stats.spawn += part.spawn;
+        end = std::max(end, part.begin + part.wall);
+    }
+    stats.wall = end - stats.begin;
+    return stats;
+}
+
+Exec::Exec(const vector<gettable> &a) :
+    argv(a)
+{
+    for (auto &s : argv)
+    {
+        if (!s->is_constant())
+            return;
+    }
+
+    const_args.reserve(argv.size());
+    for (auto &s : argv)
+        const_args.push_back(s->get(Environment::global));
+
+    const_argv.reserve(const_args.size() + 1);
+    for (auto &s : const_args)
+        const_argv.push_back(s.data());
+    const_argv.push_back(nullptr);
+}
+
+StreamFlags Exec::get_flags() const
+{
+    return {
+        .in = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
+        .out = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
+        .err = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore
+    };
+}
+
+bool Subprocess::check_stream(int stream, int flag)
+{
+    return (stream == Streams::None && (flag & StreamFlags::Ignore)) ||
+           (stream == Streams::New && (flag & StreamFlags::Create)) ||
+           ((stream >= 0 || stream == Streams::Out) && (flag & StreamFlags::Accept));
+}
+
+void Subprocess::check_streams(Streams streams) const
+{
+    StreamFlags flags = get_flags();
+    if (streams.in == Streams::Out || !check_stream(streams.in, flags.in))
+        throw std::invalid_argument("Wrong file descriptor option for stdin");
+    if (streams.out == Streams::Out || !check_stream(streams.out, flags.out))
+        throw std::invalid_argument("Wrong file descriptor option for stdout");
+    if (!check_stream(streams.err, flags.err))
+        throw std::invalid_argument("Wrong file descriptor option for stderr");
+}
+
+static void open_pipe(int &str, int fds[2], bool input, const PipeOptions &options)
+{
+    if (str != Streams::None)
+    {
+        if (str == Streams::New)
+        {
+            Pipe::create(fds, options);
+            str = fds[input ? 1 : 0];
+        }
+        else
+        {
+            fds[input ? 0 : 1] = str;
+        }
+    }
+}
+
+static void close_pipe(int fd)
+{
+    if (fd != Streams::None)
+        close(fd);
+}
+
+// Prepares the fds of each standard stream of a child, returns whether stderr goes to stdout
+static bool open_pipes(Streams &str, int fds[3][2], const PipeOptions &options)
+{
+    memset(fds, Streams::None, sizeof(int[3][2]));
+
+    open_pipe(str.in, fds[STDIN_FILENO], true, options);
+    open_pipe(str.out, fds[STDOUT_FILENO], false, options);
+    // Stderr shares the stdout fd, the inherited one without it, the child dups it after its stdout
+    if (str.err == Streams::Out)
+    {
+        fds[STDERR_FILENO][1] = fds[STDOUT_FILENO][1] != Streams::None ? fds[STDOUT_FILENO][1] : STDOUT_FILENO;
+        str.err = Streams::None;
+        return true;
+    }
+    open_pipe(str.err, fds[STDERR_FILENO], false, options);
+    return false;
+}
+
+// Closes all the fds of open_pipes()
+static void close_pipes(int fds[3][2], bool merged)
+{
+    if (merged)
+        fds[STDERR_FILENO][1] = Streams::None;
+    for (int i = 0; i < 3; i++)
+    {
+        close_pipe(fds[i][0]);
+        close_pipe(fds[i][1]);
+    }
+}
+
+// Sets up the standard streams in a forked child
+static void child_streams(const int fds[3][2])
+{
+    close_pipe(fds[STDIN_FILENO][1]);
+    close_pipe(fds[STDOUT_FILENO][0]);
+    close_pipe(fds[STDERR_FILENO][0]);
+
+    if (fds[STDIN_FILENO][0] != Streams::None)
+        dup2(fds[STDIN_FILENO][0], STDIN_FILENO);
+    if (fds[STDOUT_FILENO][1] != Streams::None)
+        dup2(fds[STDOUT_FILENO][1], STDOUT_FILENO);
+    if (fds[STDERR_FILENO][1] != Streams::None)
+        dup2(fds[STDERR_FILENO][1], STDERR_FILENO);
+}
+
+// Sets up the fds of a forked child beyond its standard streams, async-signal-safe
+// The fds in sources, or keep_fds themselves without it, end up at the numbers in keep_fds
+static void child_fds(const LaunchOptions &options, const int *sources)
+{
+    const vector<int> &keep = options.keep_fds;
+    int top = STDERR_FILENO;
+    for (int fd : keep)
+        top = std::max(top, fd);
+
+    if (sources)
+    {
+        // Moved above every target first, so no dup2 overwrites a source still to be moved
+        int *moved = static_cast<int *>(alloca(keep.size() * sizeof(int)));
+        for (size_t i = 0; i < keep.size(); i++)
+            moved[i] = fcntl(sources[i], F_DUPFD_CLOEXEC, top + 1);
+        for (size_t i = 0; i < keep.size(); i++)
+            dup2(moved[i], keep[i]);
+    }
+
+    if (options.close_fds)
+    {
+        // The flag needs Linux 5.11, before that the fds around the kept ones are closed
+        if (syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC))
+        {
+            unsigned low = STDERR_FILENO + 1;
+            while (true)
+            {
+                unsigned next = ~0U;
+                for (int fd : keep)
+                    if (unsigned(fd) >= low && unsigned(fd) < next)
+                        next = fd;
+                if (next > low)
+                    syscall(SYS_close_range, low, next == ~0U ? ~0U : next - 1, 0);
+                if (next == ~0U)
+                    break;
+                low = next + 1;
+            }
+        }
+    }
+    for (int fd : keep)
+        fcntl(fd, F_SETFD, 0);
+}
+
+// Whether options set anything child_profile() applies
+static bool has_profile(const LaunchOptions &options)
+{
+    return !options.cpus.empty() || !options.rlimits.empty() || options.nice || options.io_class ||
+           !options.cgroup.empty();
+}
+
+// The cgroup.procs file of the cgroup in options, a child joins it by writing 0 there, -1 without one
+static int open_cgroup_procs(const LaunchOptions &options)
+{
+    if (options.cgroup.empty())
+        return -1;
+    int fd = ::open((options.cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+    return fd;
+}
+
+// Applies the profile of options in a forked child, async-signal-safe, returns 0 or errno
+// cgroup is the cgroup.procs fd from open_cgroup_procs(), -1 if it's joined already or there is none
+static int child_profile(const LaunchOptions &options, int cgroup)
+{
+    if (cgroup >= 0 && ::write(cgroup, "0", 1) < 0)
+        return errno;
+    if (!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : options.cpus)
+            CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            return errno;
+    }
+    for (const auto &[resource, limit] : options.rlimits)
+    {
+        if (setrlimit(static_cast<__rlimit_resource_t>(resource), &limit))
+            return errno;
+    }
+    if (options.nice && setpriority(PRIO_PROCESS, 0, *options.nice))
+        return errno;
+    if (options.io_class &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(options.io_class, options.io_level)))
+        return errno;
+    return 0;
+}
+
+class ForkLauncher : public Launcher
+{
+  public:
+    pid_t launch(
+        char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+    ) const override
+    {
+        pid_t pid;
+        int cgroup = -1;
+        if (options.cgroup.empty())
+        {
+            pid = ::fork();
+        }
+        else
+        {
+            // Created in the cgroup, rather than moved there, which costs the kernel a migration
+            int dir = ::open(options.cgroup.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir < 0)
+                throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+            struct clone_args args = {};
+            args.flags = CLONE_INTO_CGROUP;
+            args.exit_signal = SIGCHLD;
+            args.cgroup = dir;
+            // Like fork(), the child only makes async-signal-safe calls until exec
+            pid = syscall(SYS_clone3, &args, sizeof(args));
+            if (pid < 0 && (errno == ENOSYS || errno == E2BIG))
+            {
+                // Before Linux 5.7
+                cgroup = open_cgroup_procs(options);
+                pid = ::fork();
+            }
+            int saved = errno;
+            close(dir);
+            errno = saved;
+        }
+
+        if (pid == 0)
+        { // child
+            if (options.process_group)
+                setpgid(0, 0);
+            restore_sigpipe();
+            child_streams(fds);
+            child_fds(options, nullptr);
+            int ret = child_profile(options, cgroup);
+            if (ret)
+                _exit(ret);
+            execvpe(argv[0], argv, envp);
+            _exit(errno);
+        }
+        close_pipe(cgroup);
+        if (pid < 0)
+        {
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+        }
+        // Also here, so the group exists once this returns, whichever runs first
+        if (options.process_group)
+            setpgid(pid, pid);
+        return pid;
+    }
+};
+
+// The arguments of vfork_child(), shared with the parent
+struct VForkArgs
+{
+    char *const *argv;
+    char *const *envp;
+    const int (*fds)[2];
+    const sigset_t *mask;
+    const LaunchOptions *options;
+    const int *sources; // Where the kept fds are, see child_fds()
+    int cgroup;         // See child_profile()
+    int err;
+};
+
+// Runs on its own stack but in the parent address space, the parent is suspended until exec
+static int vfork_child(void *arg)
+{
+    VForkArgs *args = static_cast<VForkArgs *>(arg);
+
+    // Signal handlers of the parent must not run in the shared memory
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        struct sigaction sa;
+        if (sigaction(sig, nullptr, &sa) == 0 && sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)
+        {
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+    sigprocmask(SIG_SETMASK, args->mask, nullptr);
+
+    if (args->options->process_group)
+        setpgid(0, 0);
+    restore_sigpipe();
+    child_streams(args->fds);
+    child_fds(*args->options, args->sources);
+    args->err = child_profile(*args->options, args->cgroup);
+    if (!args->err)
+    {
+        execvpe(args->argv[0], args->argv, args->envp);
+        args->err = errno;
+    }
+    _exit(127);
+}
+
+// clone(CLONE_VM | CLONE_VFORK) with extra flags, sets err if the child exited because exec failed
+// Returns -1 and sets errno if there is no child
+static const size_t vfork_stack_size = 64 * 1024;
+
+// stack is vfork_stack_size bytes for the child, or null to allocate them
+static pid_t vfork_exec(
+    char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int flags, int &err,
+    const int *sources = nullptr, int cgroup = -1, char *stack = nullptr
+)
+{
+    std::unique_ptr<char[]> allocated(stack ? nullptr : new char[vfork_stack_size]);
+    if (!stack)
+        stack = allocated.get();
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    VForkArgs args{argv, envp, fds, &old, &options, sources, cgroup, 0};
+    pid_t pid = clone(vfork_child, stack + vfork_stack_size, CLONE_VM | CLONE_VFORK | SIGCHLD | flags, &args);
+    int clone_errno = errno;
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    errno = clone_errno;
+    err = args.err;
+    return pid;
+}
+
+class VForkLauncher : public Launcher
+{
+  public:
+    pid_t launch(
+        char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+    ) const override
+    {
+        int cgroup = open_cgroup_procs(options);
+        pid_t pid = vfork_exec(argv, envp, fds, options, 0, err, nullptr, cgroup);
+        int saved = errno;
+        close_pipe(cgroup);
+        errno = saved;
+
+        if (pid < 0)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+        if (err)
+        {
+            waitpid(pid, nullptr, 0);
+            return -1;
+        }
+        return pid;
+    }
+};
+
+class PosixSpawnLauncher : public Launcher
+{
+  public:
+    pid_t launch(
+        char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+    ) const override
+    {
+        // posix_spawn() has no attributes for these, and there is no closefrom that skips the kept fds
+        if (has_profile(options) || (options.close_fds && !options.keep_fds.empty()))
+            return VForkLauncher().launch(argv, envp, fds, options, err);
+
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        short flags = 0;
+        if (options.process_group)
+        {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, 0);
+        }
+        if (sigpipe_ignored)
+        {
+            sigset_t pipe_set;
+            sigemptyset(&pipe_set);
+            sigaddset(&pipe_set, SIGPIPE);
+            flags |= POSIX_SPAWN_SETSIGDEF;
+            posix_spawnattr_setsigdefault(&attr, &pipe_set);
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+
+        if (fds[STDIN_FILENO][1] != Streams::None)
+            posix_spawn_file_actions_addclose(&actions, fds[STDIN_FILENO][1]);
+        if (fds[STDOUT_FILENO][0] != Streams::None)
+            posix_spawn_file_actions_addclose(&actions, fds[STDOUT_FILENO][0]);
+        if (fds[STDERR_FILENO][0] != Streams::None)
+            posix_spawn_file_actions_addclose(&actions, fds[STDERR_FILENO][0]);
+
+        if (fds[STDIN_FILENO][0] != Streams::None)
+            posix_spawn_file_actions_adddup2(&actions, fds[STDIN_FILENO][0], STDIN_FILENO);
+        if (fds[STDOUT_FILENO][1] != Streams::None)
+            posix_spawn_file_actions_adddup2(&actions, fds[STDOUT_FILENO][1], STDOUT_FILENO);
+        if (fds[STDERR_FILENO][1] != Streams::None)
+            posix_spawn_file_actions_adddup2(&actions, fds[STDERR_FILENO][1], STDERR_FILENO);
+
+        // A dup2 onto itself clears O_CLOEXEC
+        for (int fd : options.keep_fds)
+            posix_spawn_file_actions_adddup2(&actions, fd, fd);
+        if (options.close_fds)
+            posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+        pid_t pid;
+        err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        return err ? -1 : pid;
+    }
+};
+
+static const ForkLauncher fork_launcher{};
+static const VForkLauncher vfork_launcher{};
+static const PosixSpawnLauncher posix_spawn_launcher{};
+
+const Launcher &Launcher::Fork = fork_launcher;
+const Launcher &Launcher::VFork = vfork_launcher;
+const Launcher &Launcher::PosixSpawn = posix_spawn_launcher;
+
+// A launch request to the Zygote helper, followed by size bytes of the argv and envp strings,
+// the fds the child keeps come with it as SCM_RIGHTS
+struct ZygoteRequest
+{
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t keepc;   // The numbers of the kept fds follow the strings, the fds follow the streams
+    uint32_t cpuc;    // Then the CPUs
+    uint32_t rlimitc; // Then the ZygoteRlimit entries
+    uint64_t size;
+    bool has[3];      // Which standard streams are passed
+    bool process_group;
+    bool close_fds;
+    bool has_nice;
+    bool has_cgroup; // The cgroup.procs fd comes last
+    int nice;
+    int io_class;
+    int io_level;
+};
+
+struct ZygoteRlimit
+{
+    int resource;
+    struct rlimit limit;
+};
+
+// The most fds kept for a child of the helper, SCM_RIGHTS takes no more than 253 fds
+static const size_t zygote_max_kept = 64;
+// The most bytes of argv and envp strings, and of strings, a child of the helper gets, like the default ARG_MAX
+static const size_t zygote_max_size = 2 * 1024 * 1024;
+static const size_t zygote_max_strings = zygote_max_size / sizeof(char *);
+
+// What the helper needs for a request, allocated before the fork: the process may have other threads then,
+// one of which may hold the allocator lock, so the helper can't allocate
+struct ZygoteBuffers
+{
+    vector<char> data;
+    vector<char *> strings; // argv then envp, each ending with nullptr
+    LaunchOptions options;
+    std::unique_ptr<char[]> stack;
+
+    ZygoteBuffers() :
+        stack(new char[vfork_stack_size])
+    {
+        data.reserve(zygote_max_size + (zygote_max_kept + CPU_SETSIZE) * sizeof(int) +
+                     RLIM_NLIMITS * sizeof(ZygoteRlimit));
+        strings.reserve(zygote_max_strings + 2);
+        options.keep_fds.reserve(zygote_max_kept);
+        options.cpus.reserve(CPU_SETSIZE);
+        options.rlimits.reserve(RLIM_NLIMITS);
+    }
+};
+
+struct ZygoteReply
+{
+    pid_t pid;
+    int err; // errno of clone() if pid is -1, of exec otherwise
+};
+
+// Sends or receives all of the buffer over a stream socket, false if the other end is gone
+static bool socket_io(int sock, void *data, size_t size, bool send)
+{
+    char *ptr = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t count = send ? ::send(sock, ptr, size, MSG_NOSIGNAL) : ::recv(sock, ptr, size, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        ptr += count;
+        size -= count;
+    }
+    return true;
+}
+
+// The helper process, serves requests until the socket is closed
+// It only uses what's in buffers, no vector grows past the capacity reserved there
+[[noreturn]] static void zygote_serve(int sock, ZygoteBuffers &buffers)
+{
+    const int kept[3] = {0, 1, 1}; // The end of each standard stream pipe the child keeps
+
+    while (true)
+    {
+        ZygoteRequest request;
+        int received[3 + zygote_max_kept + 1];
+        char control[CMSG_SPACE(sizeof(received))];
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // The fds come with the first byte, so the header is read with them in one go
+        ssize_t count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        if (count != sizeof(request))
+            _exit(0);
+
+        size_t passed = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(received, CMSG_DATA(cmsg), passed * sizeof(int));
+            }
+        }
+
+        // launch() checks the sizes, a request that doesn't fit anyway ends the helper
+        vector<char> &data = buffers.data;
+        vector<char *> &strings = buffers.strings;
+        LaunchOptions &options = buffers.options;
+        if (request.size > data.capacity() || request.argc + request.envc + 2 > strings.capacity() ||
+            request.keepc > options.keep_fds.capacity() || request.cpuc > options.cpus.capacity() ||
+            request.rlimitc > options.rlimits.capacity())
+            _exit(0);
+        data.resize(request.size);
+        if (!socket_io(sock, data.data(), data.size(), false))
+            _exit(0);
+
+        strings.clear();
+        char *ptr = data.data();
+        for (uint32_t i = 0; i < request.argc + request.envc; i++)
+        {
+            if (i == request.argc)
+                strings.push_back(nullptr);
+            strings.push_back(ptr);
+            ptr += strlen(ptr) + 1;
+        }
+        if (request.envc == 0)
+            strings.push_back(nullptr);
+        strings.push_back(nullptr);
+        char **argv = strings.data(), **envp = strings.data() + request.argc + 1;
+
+        int fds[3][2];
+        memset(fds, Streams::None, sizeof(fds));
+        size_t next = 0;
+        for (size_t i = 0; i < 3; i++)
+            if (request.has[i] && next < passed)
+                fds[i][kept[i]] = received[next++];
+
+        options.process_group = request.process_group;
+        options.close_fds = request.close_fds;
+        int cgroup = request.has_cgroup && passed > next ? received[--passed] : -1;
+        options.keep_fds.resize(std::min<size_t>(request.keepc, passed - next));
+        options.cpus.resize(request.cpuc);
+        options.rlimits.resize(request.rlimitc);
+        const char *tail = data.data() + data.size() -
+                           (request.keepc + request.cpuc) * sizeof(int) - request.rlimitc * sizeof(ZygoteRlimit);
+        if (!options.keep_fds.empty())
+            memcpy(options.keep_fds.data(), tail, options.keep_fds.size() * sizeof(int));
+        tail += request.keepc * sizeof(int);
+        if (request.cpuc)
+            memcpy(options.cpus.data(), tail, request.cpuc * sizeof(int));
+        tail += request.cpuc * sizeof(int);
+        for (auto &[resource, limit] : options.rlimits)
+        {
+            ZygoteRlimit entry;
+            memcpy(&entry, tail, sizeof(entry));
+            tail += sizeof(entry);
+            resource = entry.resource;
+            limit = entry.limit;
+        }
+        options.nice = request.has_nice ? std::optional<int>(request.nice) : std::nullopt;
+        options.io_class = request.io_class;
+        options.io_level = request.io_level;
+
+        ZygoteReply reply{};
+        reply.pid = vfork_exec(argv, envp, fds, options, CLONE_PARENT, reply.err, received + next, cgroup,
+                               buffers.stack.get());
+        if (reply.pid < 0)
+            reply.err = errno;
+        close_pipe(cgroup);
+
+        for (size_t i = 0; i < passed; i++)
+            close(received[i]);
+
+        if (!socket_io(sock, &reply, sizeof(reply), true))
+            _exit(0);
+    }
+}
+
+Zygote::Zygote()
+{
+    // Allocated while other threads can't hold the allocator lock, the helper then never frees it
+    auto buffers = std::make_unique<ZygoteBuffers>();
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+    pid = ::fork();
+    if (pid == 0)
+    { // helper
+        // Only the standard streams and the socket are kept, it gets EOF once this process is gone
+        int helper = pair[1] == 3 ? 3 : dup3(pair[1], 3, O_CLOEXEC);
+        if (helper < 0)
+            _exit(errno);
+        syscall(SYS_close_range, 4, ~0U, 0);
+        zygote_serve(helper, *buffers);
+    }
+    else if (pid < 0)
+    {
+        int err = errno;
+        close(pair[0]);
+        close(pair[1]);
+        throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+    }
+    close(pair[1]);
+    sock = pair[0];
+}
+
+Zygote::~Zygote()
+{
+    // The helper exits once the socket is closed
+    close(sock);
+    waitpid(pid, nullptr, 0);
+}
+
+pid_t Zygote::launch(
+    char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+) const
+{
+    if (options.keep_fds.size() > zygote_max_kept)
+        throw std::invalid_argument("Too many kept fds for a Zygote");
+    if (options.cpus.size() > CPU_SETSIZE || options.rlimits.size() > RLIM_NLIMITS)
+        throw std::invalid_argument("Too many CPUs or rlimits for a Zygote");
+
+    ZygoteRequest request{};
+    request.process_group = options.process_group;
+    request.close_fds = options.close_fds;
+    request.keepc = options.keep_fds.size();
+    request.cpuc = options.cpus.size();
+    request.rlimitc = options.rlimits.size();
+    request.has_nice = options.nice.has_value();
+    request.nice = options.nice.value_or(0);
+    request.io_class = options.io_class;
+    request.io_level = options.io_level;
+    string data;
+    for (char *const *arg = argv; *arg; arg++, request.argc++)
+        data.append(*arg).push_back('\0');
+    for (char *const *var = envp; *var; var++, request.envc++)
+        data.append(*var).push_back('\0');
+    if (data.size() > zygote_max_size || request.argc + request.envc > zygote_max_strings)
+        throw std::system_error(std::error_code(E2BIG, std::system_category()), strerror(E2BIG));
+    data.append(reinterpret_cast<const char *>(options.keep_fds.data()), options.keep_fds.size() * sizeof(int));
+    data.append(reinterpret_cast<const char *>(options.cpus.data()), options.cpus.size() * sizeof(int));
+    for (const auto &[resource, limit] : options.rlimits)
+    {
+        ZygoteRlimit entry{resource, limit};
+        data.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    }
+    request.size = data.size();
+
+    // The helper starts the child, which joins the cgroup by writing to this
+    int cgroup = open_cgroup_procs(options);
+    request.has_cgroup = cgroup >= 0;
+
+    const int kept[3] = {0, 1, 1};
+    int passed[3 + zygote_max_kept + 1];
+    size_t count = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        request.has[i] = fds[i][kept[i]] != Streams::None;
+        if (request.has[i])
+            passed[count++] = fds[i][kept[i]];
+    }
+    for (int fd : options.keep_fds)
+        passed[count++] = fd;
+    if (cgroup >= 0)
+        passed[count++] = cgroup;
+
+    char control[CMSG_SPACE(sizeof(passed))] = {};
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), passed, count * sizeof(int));
+    }
+
+    ZygoteReply reply;
+    {
+        // One request at a time on the socket
+        std::lock_guard<std::mutex> lock(mutex);
+        ssize_t sent;
+        do
+            sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        while (sent < 0 && errno == EINTR);
+        // The helper has its own copy now
+        int saved = errno;
+        close_pipe(cgroup);
+        errno = saved;
+        if (sent < 0 || (sent < ssize_t(sizeof(request)) &&
+                         !socket_io(sock, reinterpret_cast<char *>(&request) + sent, sizeof(request) - sent, true)))
+            throw std::system_error(std::error_code(sent < 0 ? errno : EPIPE, std::system_category()),
+                                    "Zygote is gone");
+        if (!socket_io(sock, data.data(), data.size(), true) || !socket_io(sock, &reply, sizeof(reply), false))
+            throw std::system_error(std::error_code(EPIPE, std::system_category()), "Zygote is gone");
+    }
+
+    if (reply.pid < 0)
+        throw std::system_error(std::error_code(reply.err, std::system_category()), strerror(reply.err));
+
+    // The child that failed to exec is a child of this process, so it's reaped here
+    if (reply.err)
+    {
+        waitpid(reply.pid, nullptr, 0);
+        err = reply.err;
+        return -1;
+    }
+    return reply.pid;
+}
+
+char *const *Exec::get_argv(
+    const Environment &env, std::pmr::vector<string> &args, std::pmr::vector<char *> &c_argv
+) const
+{
+    if (!const_argv.empty())
+        return const_argv.data();
+
+    args.reserve(argv.size());
+    for (auto &s : argv)
+        args.push_back(s->get(env));
+
+    c_argv.reserve(args.size() + 1);
+    for (auto &s : args)
+        c_argv.push_back(s.data());
+    c_argv.push_back(nullptr);
+    return c_argv.data();
+}
+
+runsubprocess Exec::launch(
+    char *const argv[], char *const envp[], Streams str, int fds[3][2], bool merged, const Environment &env,
+    Stats::clock::time_point begin
+) const
+{
+    int err = 0;
+    pid_t pid;
+    try
+    {
+        pid = env.launcher->launch(argv, envp, fds, env.launch_options, err);
+    }
+    catch (...)
+    {
+        close_pipes(fds, merged);
+        throw;
+    }
+
+    close_pipe(fds[STDIN_FILENO][0]);
+    close_pipe(fds[STDOUT_FILENO][1]);
+    if (!merged)
+        close_pipe(fds[STDERR_FILENO][1]);
+
+    string name = string("exec ") + argv[0];
+
+    // Like a child that failed to exec, return the errno as the return code
+    if (pid < 0)
+        return runsubprocess(new RunEmpty(str, err, name));
+
+    Stats record{.name = std::move(name), .begin = begin, .spawn = Stats::clock::now() - begin};
+    return runsubprocess(new RunExec(pid, env.launch_options.process_group, str, std::move(record)));
+}
+
+runsubprocess Exec::start(Streams str, const Environment &env) const
+{
+    Stats::clock::time_point begin = Stats::clock::now();
+    check_streams(str);
+    if (argv.empty())
+        throw std::invalid_argument("No command to execute");
+
+    // Everything the child needs is prepared before it is started
+    std::pmr::vector<string> args{RunArena::current()};
+    std::pmr::vector<char *> c_argv{RunArena::current()};
+    char *const *argvp = get_argv(env, args, c_argv);
+    std::shared_ptr<const Environment::Envp> envp = env.envp();
+
+    int fds[3][2];
+    bool merged = open_pipes(str, fds, env.pipe_options);
+    return launch(argvp, envp->ptrs.data(), str, fds, merged, env, begin);
+}
+
+vector<runsubprocess> Exec::start_many(size_t n, Streams str, const Environment &env) const
+{
+    check_streams(str);
+    if (argv.empty())
+        throw std::invalid_argument("No command to execute");
+
+    // The arguments and envp are the same for every copy
+    std::pmr::vector<string> args{RunArena::current()};
+    std::pmr::vector<char *> c_argv{RunArena::current()};
+    char *const *argvp = get_argv(env, args, c_argv);
+    std::shared_ptr<const Environment::Envp> envp = env.envp();
+
+    // The pipes are created right before each launch, every fd open in the parent makes
+    // the fd table the next child copies bigger
+    vector<runsubprocess> runs;
+    runs.reserve(n);
+    try
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            Stats::clock::time_point begin = Stats::clock::now();
+            Streams copy = i + 1 < n ? shared_streams(str) : str;
+            int fds[3][2];
+            bool merged = open_pipes(copy, fds, env.pipe_options);
+            runs.push_back(launch(argvp, envp->ptrs.data(), copy, fds, merged, env, begin));
+        }
+    }
+    catch (...)
+    {
+        abandon(runs, str);
+        throw;
+    }
+    return runs;
+}
+
+void Exec::get_variables(Variables &vars) const
+{
+    for (const gettable &arg : argv)
+        arg->get_variables(vars.reads);
+    vars.exports = true;
+}
+
+subprocess Exec::copy() const
+{
+    return subprocess(new Exec(argv));
+}
+
+RunExec::RunExec(pid_t pid, bool group, Streams streams, Stats &&record) :
+    pid(pid),
+    group(group),
+    reaped(false),
+    streams(streams),
+    record(std::move(record))
+{
+}
+
+void RunExec::cancel(int sig)
+{
+    // Until it's reaped, even as a zombie, the pid and the group id can't be reused
+    std::lock_guard<std::mutex> lock(mutex);
+    if (reaped)
+        return;
+    // The group outlives its leader, it's signalled first so none of it is missed
+    if (group)
+        kill(-pid, sig);
+    kill(pid, sig);
+}
+
+int RunExec::finish(int ret, int signal, const struct rusage &usage)
+{
+    record.ret = ret;
+    record.signal = signal;
+    record.wall = Stats::clock::now() - record.begin;
+    record.user = std::chrono::seconds(usage.ru_utime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec);
+    record.system = std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+    record.max_rss = usage.ru_maxrss;
+    return ret;
+}
+
+int RunExec::wait()
+{
+    // It's waited for without reaping it first, then marked reaped for cancel()
+    siginfo_t siginfo;
+    if (waitid(P_PID, pid, &siginfo, WEXITED | WSTOPPED | WNOWAIT) < 0)
+        return -1;
+    if (siginfo.si_code != CLD_STOPPED)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reaped = true;
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, WUNTRACED, &usage) < 0)
+        return -1;
+
+    // The same code waitid() reports in si_status
+    if (WIFEXITED(status))
+        return finish(WEXITSTATUS(status), 0, usage);
+    if (WIFSIGNALED(status))
+        return finish(WTERMSIG(status), WTERMSIG(status), usage);
+    return finish(WSTOPSIG(status), 0, usage);
+}
+
+void RunExec::on_exit(Executor &executor, std::function<void(int)> &&done)
+{
+    // Only opened for a watch, which closes it when done, not reaped yet the pid is still the child's
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd < 0)
+    {
+        RunSubprocess::on_exit(executor, std::move(done));
+        return;
+    }
+
+    // The pidfd becomes readable when the child exits
+    executor.watch(pidfd, Executor::Readable, [this, pidfd, done = std::move(done)]() {
+        siginfo_t siginfo;
+        struct rusage usage;
+        siginfo.si_pid = 0;
+        // Like wait(), it's marked reaped before it is
+        if (syscall(SYS_waitid, P_PIDFD, pidfd, &siginfo, WEXITED | WNOHANG | WNOWAIT, nullptr))
+        {
+            if (errno == EAGAIN)
+                return false;
+            done(-1);
+            return true;
+        }
+        if (siginfo.si_pid == 0)
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reaped = true;
+        }
+        // Unlike the glibc wrapper the system call also reports the resource usage
+        if (syscall(SYS_waitid, P_PIDFD, pidfd, &siginfo, WEXITED, &usage))
+        {
+            done(-1);
+            return true;
+        }
+        bool killed = siginfo.si_code == CLD_KILLED || siginfo.si_code == CLD_DUMPED;
+        done(finish(siginfo.si_status, killed ? siginfo.si_status : 0, usage));
+        return true;
+    });
+}
+
+Stats RunExec::stats() const
+{
+    return record;
+}
+
+Streams RunExec::get_streams() const
+{
+    return streams;
+}
+
+Or::Or(const subprocess &lhs, const subprocess &rhs) :
+    lhs(lhs),
+    rhs(rhs)
+{
+}
+
+void Or::get_variables(Variables &vars) const
+{
+    lhs->get_variables(vars);
+    rhs->get_variables(vars);
+}
+
+subprocess Or::copy() const
+{
+    return subprocess(new Or(lhs, rhs));
+}
+
+runsubprocess Or::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+    return runsubprocess(new RunThread(
+        env,
+        "||",
+        [lhs = lhs, rhs = rhs, &env](RunThread &self, Stats &stats) {
+            stats.ret = !(!self.run_part(lhs, env, stats) || !self.run_part(rhs, env, stats));
+        },
+        str
+    ));
+}
+
+runsubprocess Or::start(Streams str, Environment &env) const
+{
+    check_streams(str);
+    return runsubprocess(new RunThread(
+        env,
+        "||",
+        [lhs = lhs, rhs = rhs, &env](RunThread &self, Stats &stats) {
+            stats.ret = !(!self.run_part(lhs, env, stats) || !self.run_part(rhs, env, stats));
+        },
+        str
+    ));
+}
+
+// The same as the RunThread of start() does, but on this thread
+template <typename E>
+int Or::evaluate(E env, Stats &stats) const
+{
+    stats.name = "||";
+    stats.begin = Stats::clock::now();
+    Stats part{};
+    int ret = lhs->execute(env, part);
+    if (env.tracer)
+        stats.add(std::move(part));
+    if (ret)
+    {
+        part = {};
+        ret = rhs->execute(env, part);
+        if (env.tracer)
+            stats.add(std::move(part));
+    }
+    stats.ret = ret ? 1 : 0;
+    stats.wall = Stats::clock::now() - stats.begin;
+    return stats.ret;
+}
+
+int Or::execute(const Environment &env, Stats &stats) const
+{
+    return evaluate<const Environment &>(env, stats);
+}
+
+int Or::execute(Environment &env, Stats &stats) const
+{
+    return evaluate<Environment &>(env, stats);
+}
+
+And::And(const subprocess &lhs, const subprocess &rhs) :
+    lhs(lhs),
+    rhs(rhs)
+{
+}
+
+void And::get_variables(Variables &vars) const
+{
+    lhs->get_variables(vars);
+    rhs->get_variables(vars);
+}
+
+subprocess And::copy() const
+{
+    return subprocess(new And(lhs, rhs));
+}
+
+runsubprocess And::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+    return runsubprocess(new RunThread(
+        env,
+        "&&",
+        [lhs = lhs, rhs = rhs, &env](RunThread &self, Stats &stats) {
+            stats.ret = !(!self.run_part(lhs, env, stats) && !self.run_part(rhs, env, stats));
+        },
+        str
+    ));
+}
+
+runsubprocess And::start(Streams str, Environment &env) const
+{
+    check_streams(str);
+    return runsubprocess(new RunThread(
+        env,
+        "&&",
+        [lhs = lhs, rhs = rhs, &env](RunThread &self, Stats &stats) {
+            stats.ret = !(!self.run_part(lhs, env, stats) && !self.run_part(rhs, env, stats));
+        },
+        str
+    ));
+}
+
+// The same as the RunThread of start() does, but on this thread
+template <typename E>
+int And::evaluate(E env, Stats &stats) const
+{
+    stats.name = "&&";
+    stats.begin = Stats::clock::now();
+    Stats part{};
+    int ret = lhs->execute(env, part);
+    if (env.tracer)
+        stats.add(std::move(part));
+    if (!ret)
+    {
+        part = {};
+        ret = rhs->execute(env, part);
+        if (env.tracer)
+            stats.add(std::move(part));
+    }
+    stats.ret = ret ? 1 : 0;
+    stats.wall = Stats::clock::now() - stats.begin;
+    return stats.ret;
+}
+
+int And::execute(const Environment &env, Stats &stats) const
+{
+    return evaluate<const Environment &>(env, stats);
+}
+
+int And::execute(Environment &env, Stats &stats) const
+{
+    return evaluate<Environment &>(env, stats);
+}
+
+ErrPipe::ErrPipe(const subprocess &lhs, const subprocess &rhs) :
+    lhs(lhs),
+    rhs(rhs)
+{
+}
+
+StreamFlags ErrPipe::get_flags() const
+{
+    StreamFlags lhs_f = lhs->get_flags();
+    return {.in = lhs_f.in, .out = lhs_f.out, .err = StreamFlags::Ignore};
+}
+
+void ErrPipe::get_variables(Variables &vars) const
+{
+    lhs->get_variables(vars);
+    rhs->get_variables(vars);
+}
+
+subprocess ErrPipe::copy() const
+{
+    return subprocess(new ErrPipe(lhs, rhs));
+}
+
+template <typename E>
+runsubprocess ErrPipe::start(Streams str, E env) const
+{
+    check_streams(str);
+
+    StreamFlags lhs_f = lhs->get_flags();
+    StreamFlags rhs_f = rhs->get_flags();
+
+    // Like Pipe::start, the side that can create the fd does, rhs writes to the inherited stdout
+    runsubprocess lhs_p;
+    runsubprocess rhs_p;
+    if ((lhs_f.err & StreamFlags::Create) && (rhs_f.in & StreamFlags::Accept))
+    {
+        lhs_p = lhs->start({.in = str.in, .out = str.out, .err = Streams::New}, env);
+        rhs_p = rhs->start({.in = lhs_p->get_streams().err}, env);
+    }
+    else if ((lhs_f.err & StreamFlags::Accept) && (rhs_f.in & StreamFlags::Create))
+    {
+        // e.g. a file
+        rhs_p = rhs->start({.in = Streams::New}, env);
+        lhs_p = lhs->start({.in = str.in, .out = str.out, .err = rhs_p->get_streams().in}, env);
+    }
+    else
+    {
+        throw std::invalid_argument("Invalid stderr pipe connection attempt");
+    }
+
+    Streams streams = lhs_p->get_streams();
+    streams.err = Streams::None;
+    return runsubprocess(new RunPipe(std::move(lhs_p), std::move(rhs_p), streams, "2>"));
+}
+
+runsubprocess ErrPipe::start(Streams str, const Environment &env) const
+{
+    return start<const Environment &>(str, env);
+}
+
+runsubprocess ErrPipe::start(Streams str, Environment &env) const
+{
+    return start<Environment &>(str, env);
+}
+
+MergeErr::MergeErr(const subprocess &sub) :
+    sub(sub)
+{
+}
+
+StreamFlags MergeErr::get_flags() const
+{
+    StreamFlags flags = sub->get_flags();
+    return {.in = flags.in, .out = flags.out, .err = StreamFlags::Ignore};
+}
+
+void MergeErr::get_variables(Variables &vars) const
+{
+    sub->get_variables(vars);
+}
+
+subprocess MergeErr::copy() const
+{
+    return subprocess(new MergeErr(sub));
+}
+
+// A builtin writes no stderr, so there's nothing to merge
+static int merged_err(const subprocess &sub)
+{
+    return (sub->get_flags().err & StreamFlags::Accept) ? Streams::Out : Streams::None;
+}
+
+runsubprocess MergeErr::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+    return sub->start({.in = str.in, .out = str.out, .err = merged_err(sub)}, env);
+}
+
+runsubprocess MergeErr::start(Streams str, Environment &env) const
+{
+    check_streams(str);
+    return sub->start({.in = str.in, .out = str.out, .err = merged_err(sub)}, env);
+}
+
+RunThread::RunThread(
+    const Environment &env, const string &name, std::function<void(RunThread &, Stats &)> &&fun, Streams str
+) :
+    record{.name = name, .begin = Stats::clock::now()},
+    done(false),
+    cancelled(0),
+    part(nullptr),
+    streams(str)
+{
+    // The task owns record once it's submitted
+    record.spawn = Stats::clock::now() - record.begin;
+    env.executor->execute([this, fun = std::move(fun)]() {
+        fun(*this, record);
+        finish();
+    });
+}
+
+RunThread::RunThread(
+    const Environment &env, const string &name, int fd, int events, std::function<bool(Stats &)> &&step,
+    Streams str
+) :
+    record{.name = name, .begin = Stats::clock::now()},
+    done(false),
+    cancelled(0),
+    part(nullptr),
+    streams(str)
+{
+    // The watch owns record once it's submitted
+    record.spawn = Stats::clock::now() - record.begin;
+    env.executor->watch(fd, events, [this, step = std::move(step)]() {
+        if (!step(record))
+            return false;
+        finish();
+        return true;
+    });
+}
+
+RunThread::~RunThread()
+{
+    // The task refers to this object, so it can't be left running
+    wait();
+}
+
+template <typename E>
+int RunThread::run_part(const subprocess &sub, E &env, Stats &parent)
+{
+    RunArena arena{};
+    runsubprocess running;
+    {
+        // Once cancelled no more parts are started, the running one is cancelled by cancel()
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled)
+            return ECANCELED;
+        running = sub->start({}, env);
+        part = running.get();
+    }
+    int ret = running->wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        part = nullptr;
+    }
+    if (env.tracer)
+        parent.add(running->stats());
+    else if (!parent.signal)
+        parent.signal = running->stats().signal;
+    return ret;
+}
+
+void RunThread::cancel(int sig)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = sig;
+    if (part)
+        part->cancel(sig);
+}
+
+void RunThread::finish()
+{
+    std::function<void(int)> callback;
+    int code;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        record.wall = Stats::clock::now() - record.begin;
+        callback = std::move(exit_callback);
+        code = record.ret;
+        cv.notify_all();
+    }
+    // This object may already be gone here
+    if (callback)
+        callback(code);
+}
+
+void RunThread::on_exit(Executor &executor, std::function<void(int)> &&callback)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!done)
+    {
+        exit_callback = std::move(callback);
+        return;
+    }
+    lock.unlock();
+    callback(record.ret);
+}
+
+Streams RunThread::get_streams() const
+{
+    return streams;
+}
+
+int RunThread::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return done; });
+    return record.ret;
+}
+
+Stats RunThread::stats() const
+{
+    return record;
+}
+
+void Executor::watch(int fd, int events, std::function<bool()> &&step)
+{
+    execute([fd, events, step = std::move(step)]() {
+        struct pollfd pfd
+        {
+            .fd = fd, .events = static_cast<short>((events & Readable ? POLLIN : 0) | (events & Writable ? POLLOUT : 0)),
+            .revents = 0
+        };
+        while (!step())
+            poll(&pfd, 1, -1);
+        close(fd);
+    });
+}
+
+class ThreadExecutor : public Executor
+{
+  public:
+    void execute(std::function<void()> &&task) override
+    {
+        std::thread(std::move(task)).detach();
+    }
+};
+
+static ThreadExecutor thread_executor{};
+
+Executor &Executor::Threads = thread_executor;
+
+ThreadPool::ThreadPool(size_t threads) :
+    idle(0),
+    stop(false)
+{
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        idle++;
+        cv.wait(lock, [this] { return stop || !tasks.empty(); });
+        idle--;
+        if (tasks.empty())
+            return;
+
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+void ThreadPool::execute(std::function<void()> &&task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle > tasks.size())
+        {
+            tasks.push_back(std::move(task));
+            cv.notify_one();
+            return;
+        }
+    }
+    std::thread(std::move(task)).detach();
+}
+
+EventLoop::EventLoop(size_t threads) :
+    pool(std::in_place, threads),
+    tasks(*pool),
+    stop(false)
+{
+    create();
+    thread = std::thread(&EventLoop::loop, this);
+}
+
+EventLoop::EventLoop(Executor &tasks) :
+    tasks(tasks),
+    stop(false)
+{
+    create();
+}
+
+EventLoop::~EventLoop()
+{
+    if (thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake();
+        thread.join();
+    }
+    close(wakefd);
+    close(epfd);
+}
+
+void EventLoop::create()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epfd < 0 || wakefd < 0)
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+    struct epoll_event ev
+    {
+        .events = EPOLLIN, .data = {.ptr = nullptr}
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev))
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+}
+
+void EventLoop::wake()
+{
+    uint64_t one = 1;
+    ssize_t _ = ::write(wakefd, &one, sizeof(one));
+    (void)_;
+}
+
+void EventLoop::execute(std::function<void()> &&task)
+{
+    tasks.execute(std::move(task));
+}
+
+void EventLoop::watch(int fd, int events, std::function<bool()> &&step)
+{
+    Watch *w = new Watch{fd, std::move(step)};
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev
+    {
+        .events = (events & Readable ? EPOLLIN : 0u) | (events & Writable ? EPOLLOUT : 0u), .data = {.ptr = w}
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+        return;
+
+    if (errno != EPERM)
+    {
+        int err = errno;
+        delete w;
+        throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.push_back(w);
+    wake();
+}
+
+void EventLoop::loop()
+{
+    while (poll())
+        ;
+}
+
+bool EventLoop::poll()
+{
+    const int maxevents = 64;
+    struct epoll_event events[maxevents];
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop)
+            return false;
+        steps.insert(steps.end(), ready.begin(), ready.end());
+        ready.clear();
+    }
+
+    // The always ready watches get one step each per call
+    for (size_t i = steps.size(); i > 0; i--)
+    {
+        Watch *w = steps.front();
+        steps.pop_front();
+        if (w->step())
+        {
+            close(w->fd);
+            delete w;
+        }
+        else
+            steps.push_back(w);
+    }
+
+    int count = epoll_wait(epfd, events, maxevents, steps.empty() ? -1 : 0);
+    for (int i = 0; i < count; i++)
+    {
+        Watch *w = static_cast<Watch *>(events[i].data.ptr);
+        if (!w)
+        {
+            uint64_t value;
+            ssize_t _ = ::read(wakefd, &value, sizeof(value));
+            (void)_;
+        }
+        else if (w->step())
+        {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+            close(w->fd);
+            delete w;
+        }
+    }
+    return true;
+}
+
+// The queues shared with the kernel, mapped from the ring fd
+struct Uring::Ring
+{
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned entries;
+    unsigned pending; // Queued but not submitted yet
+
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    Ring(unsigned size)
+    {
+        struct io_uring_params params
+        {
+        };
+        fd = static_cast<int>(syscall(SYS_io_uring_setup, size, &params));
+        if (fd < 0)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+        // Older kernels map the queues separately and drop completions when they overflow
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+        {
+            close(fd);
+            throw std::system_error(std::error_code(ENOSYS, std::system_category()), strerror(ENOSYS));
+        }
+
+        entries = params.sq_entries;
+        pending = 0;
+        rings_size = std::max(
+            params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)
+        );
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void *mapped =
+            rings == MAP_FAILED
+                ? MAP_FAILED
+                : mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (mapped == MAP_FAILED)
+        {
+            int err = errno;
+            if (rings != MAP_FAILED)
+                munmap(rings, rings_size);
+            close(fd);
+            throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+        }
+        sqes = static_cast<struct io_uring_sqe *>(mapped);
+
+        char *base = static_cast<char *>(rings);
+        sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+        sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+        sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+        cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+    }
+
+    ~Ring()
+    {
+        munmap(sqes, sqes_size);
+        munmap(rings, rings_size);
+        close(fd);
+    }
+
+    int enter(unsigned submit, unsigned wait)
+    {
+        return static_cast<int>(
+            syscall(SYS_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0)
+        );
+    }
+};
+
+Uring::Uring(size_t threads, unsigned entries) :
+    pool(threads),
+    ring(std::make_unique<Ring>(entries)),
+    woken(false),
+    stop(false)
+{
+    thread = std::thread(&Uring::loop, this);
+}
+
+Uring::~Uring()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        // A nop completion wakes up the loop
+        queue(nullptr);
+        submit();
+    }
+    thread.join();
+}
+
+void Uring::queue(Watch *w)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+        submit();
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (w)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->fd;
+        sqe->poll32_events = w->events;
+    }
+    else
+        sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = reinterpret_cast<uint64_t>(w);
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+void Uring::submit()
+{
+    bool wake = false;
+    while (ring->pending)
+    {
+        int count = ring->enter(ring->pending, 0);
+        if (count >= 0)
+        {
+            ring->pending -= count;
+            // The loop may be waiting for the completions reaped here, a nop wakes it up
+            if (!ring->pending && std::exchange(wake, false))
+                queue(nullptr);
+        }
+        else if (errno == EBUSY)
+        {
+            // Completions overflowed the queue, the kernel keeps them (NODROP) until the queue has room,
+            // so they're reaped for the loop
+            reap(reaped, woken);
+            wake = true;
+        }
+        else if (errno != EINTR && errno != EAGAIN)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+    }
+}
+
+void Uring::reap(vector<Watch *> &batch, bool &nop)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        Watch *w = reinterpret_cast<Watch *>(ring->cqes[head & ring->cq_mask].user_data);
+        if (w)
+            batch.push_back(w);
+        else
+            nop = true;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void Uring::execute(std::function<void()> &&task)
+{
+    pool.execute(std::move(task));
+}
+
+void Uring::watch(int fd, int events, std::function<bool()> &&step)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    // Regular files always poll ready, so they need no special case as with epoll
+    unsigned polled = (events & Readable ? static_cast<unsigned>(POLLIN) : 0u) |
+                      (events & Writable ? static_cast<unsigned>(POLLOUT) : 0u);
+    Watch *w = new Watch{fd, polled, std::move(step)};
+    std::lock_guard<std::mutex> lock(mutex);
+    queue(w);
+    submit();
+}
+
+void Uring::loop()
+{
+    vector<Watch *> batch, rearm;
+
+    while (true)
+    {
+        if (ring->enter(0, 1) < 0 && errno != EINTR)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+        {
+            // Completions are only reaped under the lock the watches were queued with,
+            // which orders their setup before the steps here
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.swap(reaped);
+            bool nop = std::exchange(woken, false);
+            reap(batch, nop);
+            if (nop && stop)
+                return;
+        }
+
+        // Polls are one shot, the watches that would block again are re-armed together
+        for (Watch *w : batch)
+        {
+            if (w->step())
+            {
+                close(w->fd);
+                delete w;
+            }
+            else
+                rearm.push_back(w);
+        }
+        batch.clear();
+        if (rearm.empty())
+            continue;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Watch *w : rearm)
+            queue(w);
+        rearm.clear();
+        submit();
+    }
+}
+
+JobSet::JobSet(Executor &executor) :
+    executor(executor),
+    finished(std::make_shared<Finished>()),
+    jobs{},
+    next(0)
+{
+}
+
+JobSet::~JobSet()
+{
+    // The watches refer to the jobs, so they can't be destroyed while running
+    wait_all();
+}
+
+size_t JobSet::add(runsubprocess &&job)
+{
+    size_t id = next++;
+    RunSubprocess &running = *job;
+    jobs.emplace(id, std::move(job));
+    running.on_exit(executor, [finished = finished, id](int ret) {
+        std::lock_guard<std::mutex> lock(finished->mutex);
+        finished->jobs.emplace_back(id, ret);
+        finished->cv.notify_one();
+    });
+    return id;
+}
+
+size_t JobSet::size() const
+{
+    return jobs.size();
+}
+
+std::pair<size_t, int> JobSet::collect(std::unique_lock<std::mutex> &lock)
+{
+    std::pair<size_t, int> job = finished->jobs.front();
+    finished->jobs.pop_front();
+    lock.unlock();
+    jobs.erase(job.first);
+    return job;
+}
+
+std::pair<size_t, int> JobSet::wait_any()
+{
+    if (jobs.empty())
+        throw std::logic_error("No jobs to wait for");
+
+    std::unique_lock<std::mutex> lock(finished->mutex);
+    finished->cv.wait(lock, [this] { return !finished->jobs.empty(); });
+    return collect(lock);
+}
+
+std::optional<std::pair<size_t, int>> JobSet::try_wait_any()
+{
+    std::unique_lock<std::mutex> lock(finished->mutex);
+    if (finished->jobs.empty())
+        return std::nullopt;
+    return collect(lock);
+}
+
+int JobSet::wait_all()
+{
+    int ret = 0;
+    while (!jobs.empty())
+    {
+        int code = wait_any().second;
+        if (ret == 0)
+            ret = code;
+    }
+    return ret;
+}
+
+// Writes all of data to fd, returns true once done or if the reader is gone
+static bool write_all(int fd, const string &data, size_t &offset)
+{
+    while (offset < data.size())
+    {
+        ssize_t count = ::write(fd, data.data() + offset, data.size() - offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return errno != EAGAIN;
+        offset += count;
+    }
+    return true;
+}
+
+// Reads what there is from fd into data, returns true at the end
+static bool read_all(int fd, string &data)
+{
+    char buffer[64 * 1024];
+    while (true)
+    {
+        ssize_t count = ::read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return errno != EAGAIN;
+        if (count == 0)
+            return true;
+        data.append(buffer, count);
+    }
+}
+
+vector<BatchResult> run_batch(
+    const subprocess &subprocess, const vector<string> &inputs, size_t parallelism, const Environment &env
+)
+{
+    if (parallelism == 0)
+        parallelism = std::max(1u, std::thread::hardware_concurrency());
+    // A copy that exits without reading all its input has to give EPIPE
+    ignore_sigpipe();
+
+    vector<BatchResult> results(inputs.size());
+    // Each running copy is done once its stdin, its stdout and its exit are
+    vector<runsubprocess> runs(inputs.size());
+    vector<int> left(inputs.size());
+    vector<size_t> finished;
+    size_t next = 0;
+    size_t running = 0;
+    std::exception_ptr error;
+
+    // Driven from this thread, the tasks that block go to the executor of env
+    EventLoop loop{*env.executor};
+    std::mutex mutex;
+    vector<std::pair<size_t, int>> exits, exited;
+    auto part = [&](size_t item) {
+        if (--left[item] == 0)
+            finished.push_back(item);
+    };
+
+    while ((!error && next < inputs.size()) || running)
+    {
+        if (!error && next < inputs.size() && running < parallelism)
+        {
+            try
+            {
+                size_t n = std::min(parallelism - running, inputs.size() - next);
+                for (runsubprocess &started : subprocess->start_many(n, {.in = Streams::New, .out = Streams::New}, env))
+                {
+                    size_t item = next++;
+                    Streams streams = started->get_streams();
+                    runs[item] = std::move(started);
+                    left[item] = 3;
+                    running++;
+
+                    size_t offset = 0;
+                    loop.watch(streams.in, Executor::Writable, [&, item, fd = streams.in, offset]() mutable {
+                        if (!write_all(fd, inputs[item], offset))
+                            return false;
+                        part(item);
+                        return true;
+                    });
+                    loop.watch(streams.out, Executor::Readable, [&, item, fd = streams.out]() {
+                        if (!read_all(fd, results[item].out))
+                            return false;
+                        part(item);
+                        return true;
+                    });
+                    runs[item]->on_exit(loop, [&, item](int ret) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        exits.emplace_back(item, ret);
+                        loop.wake();
+                    });
+                }
+            }
+            catch (...)
+            {
+                // The copies already running are stopped, the loop goes on until they're gone
+                error = std::current_exception();
+                for (runsubprocess &run : runs)
+                {
+                    if (run)
+                        run->cancel(SIGKILL);
+                }
+            }
+        }
+        else
+        {
+            loop.poll();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exited.swap(exits);
+        }
+        for (auto [item, ret] : exited)
+        {
+            results[item].ret = ret;
+            part(item);
+        }
+        exited.clear();
+        for (size_t item : finished)
+        {
+            runs[item].reset();
+            running--;
+        }
+        finished.clear();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+    return results;
+}
+
+Coprocess::Coprocess(const subprocess &sub, char delimiter, const Environment &env) :
+    sub(sub),
+    env(env),
+    delimiter(delimiter),
+    in(Streams::None),
+    out(Streams::None),
+    broken(false)
+{
+    // A coprocess that exited before reading its request has to give EPIPE
+    ignore_sigpipe();
+    start();
+}
+
+Coprocess::~Coprocess()
+{
+    stop(0);
+}
+
+void Coprocess::start()
+{
+    running = sub->start({.in = Streams::New, .out = Streams::New}, env);
+    Streams streams = running->get_streams();
+    in = streams.in;
+    out = streams.out;
+    for (int fd : {in, out})
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    broken = false;
+    buffer.clear();
+}
+
+void Coprocess::stop(int sig)
+{
+    if (!running)
+        return;
+    // Without its stdin it ends on its own, unless killed right away, and without its stdout
+    // it can't block writing output nobody reads anymore
+    close(in);
+    close(out);
+    if (sig)
+        running->cancel(sig);
+    running->wait();
+    running.reset();
+    in = out = Streams::None;
+}
+
+void Coprocess::restart()
+{
+    stop(SIGKILL);
+    start();
+}
+
+bool Coprocess::alive() const
+{
+    // Its stdout is hung up once it exited
+    struct pollfd pfd
+    {
+        .fd = out, .events = POLLIN, .revents = 0
+    };
+    return running && !broken && !(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)));
+}
+
+string Coprocess::request(std::string_view request)
+{
+    if (!alive())
+        restart();
+
+    // The request is written while the response is read, so a big one can't fill both pipes
+    size_t sent = 0;
+    size_t scanned = 0;
+    const size_t total = request.size() + 1;
+    while (true)
+    {
+        while (sent < total)
+        {
+            struct iovec iov[2];
+            int count = 0;
+            if (sent < request.size())
+                iov[count++] = {const_cast<char *>(request.data()) + sent, request.size() - sent};
+            iov[count++] = {&delimiter, 1};
+            ssize_t written = writev(in, iov, count);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0 && errno == EAGAIN)
+                break;
+            if (written < 0)
+            {
+                int err = errno;
+                broken = true;
+                throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+            }
+            sent += written;
+        }
+
+        size_t end = buffer.find(delimiter, scanned);
+        if (end != string::npos && sent == total)
+        {
+            string response = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return response;
+        }
+        scanned = buffer.size();
+
+        struct pollfd fds[2] = {
+            {.fd = out, .events = POLLIN, .revents = 0},
+            {.fd = in, .events = static_cast<short>(sent < total ? POLLOUT : 0), .revents = 0}
+        };
+        if (poll(fds, sent < total ? 2 : 1, -1) < 0 && errno != EINTR)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+        if (!fds[0].revents)
+            continue;
+
+        char chunk[64 * 1024];
+        ssize_t count = ::read(out, chunk, sizeof(chunk));
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (count <= 0)
+        {
+            // It exited or closed its stdout before responding
+            int err = count < 0 ? errno : EPIPE;
+            broken = true;
+            throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+        }
+        buffer.append(chunk, count);
+    }
+}
+
+CoprocessPool::CoprocessPool(const subprocess &sub, size_t size, char delimiter, const Environment &env)
+{
+    if (size == 0)
+        throw std::invalid_argument("A pool needs at least one coprocess");
+
+    coprocesses.reserve(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        coprocesses.push_back(std::make_unique<Coprocess>(sub, delimiter, env));
+        idle.push_back(coprocesses.back().get());
+    }
+}
+
+string CoprocessPool::request(std::string_view request)
+{
+    Coprocess *coprocess;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !idle.empty(); });
+        coprocess = idle.back();
+        idle.pop_back();
+    }
+
+    auto release = [this, coprocess]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(coprocess);
+        cv.notify_one();
+    };
+    try
+    {
+        string response = coprocess->request(request);
+        release();
+        return response;
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+}
+
+size_t CoprocessPool::size() const
+{
+    return coprocesses.size();
+}
+
+Cancellation::Cancellation() :
+    runs{},
+    signal(0),
+    stop(false)
+{
+}
+
+Cancellation::Cancellation(Stats::clock::duration timeout, int sig) :
+    runs{},
+    signal(0),
+    stop(false)
+{
+    Stats::clock::time_point deadline = Stats::clock::now() + timeout;
+    timer = std::thread([this, deadline, sig]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (cv.wait_until(lock, deadline, [this] { return stop; }))
+            return;
+        lock.unlock();
+        cancel(sig);
+    });
+}
+
+Cancellation::~Cancellation()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        cv.notify_all();
+    }
+    if (timer.joinable())
+        timer.join();
+}
+
+void Cancellation::cancel(int sig)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (signal == 0)
+        signal = sig;
+    for (RunSubprocess *running : runs)
+        running->cancel(sig);
+}
+
+bool Cancellation::cancelled() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return signal != 0;
+}
+
+void Cancellation::add(RunSubprocess *running)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    runs.push_back(running);
+    if (signal)
+        running->cancel(signal);
+}
+
+void Cancellation::remove(RunSubprocess *running)
+{
+    // Under the lock, so cancel() never sees a run that's gone
+    std::lock_guard<std::mutex> lock(mutex);
+    runs.erase(std::find(runs.begin(), runs.end(), running));
+}
+
+runsubprocess spawn(const subprocess &subprocess, Environment &env)
+{
+    return subprocess->start({}, env);
+}
+
+runsubprocess spawn(const subprocess &subprocess, const Environment &env)
+{
+    return subprocess->start({}, env);
+}
+
+Read::Read(const string &name) :
+    name(name)
+{
+}
+
+StreamFlags Read::get_flags() const
+{
+    return {.in = StreamFlags::Create | StreamFlags::Accept, .out = StreamFlags::Ignore, .err = StreamFlags::Ignore};
+}
+
+void Read::get_variables(Variables &vars) const
+{
+    vars.writes.push_back(name);
+}
+
+subprocess Read::copy() const
+{
+    return subprocess(new Read(name));
+}
+
+runsubprocess Read::start(Streams str, const Environment &env) const
+{
+    throw std::invalid_argument("Can't create variable in const Environment");
+}
+
+bool Read::takes_input() const
+{
+    return true;
+}
+
+runsubprocess Read::start_with(string &&in, Streams str, const Environment &env) const
+{
+    throw std::invalid_argument("Can't create variable in const Environment");
+}
+
+runsubprocess Read::start_with(string &&in, Streams str, Environment &env) const
+{
+    auto running = new RunEmpty(str, 0, "read " + name);
+    running->record.bytes = in.size();
+    if (!in.empty() && in.back() == '\n')
+        in.pop_back();
+    env.set(name, std::move(in));
+    return runsubprocess(running);
+}
+
+// The first read of a Read builtin, the whole file or what a pipe can hold
+static size_t read_size(int fd)
+{
+    const size_t fallback = 64 * 1024;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        return st.st_size + 1; // One more byte to see the end of file without growing
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    return pipe_size > 0 ? pipe_size : fallback;
+}
+
+runsubprocess Read::start(Streams str, Environment &env) const
+{
+    check_streams(str);
+    int fds[2];
+    open_pipe(str.in, fds, true, env.pipe_options);
+
+    return runsubprocess(new RunThread(
+        env,
+        "read " + name,
+        fds[0],
+        Executor::Readable,
+        [fd = fds[0], out = string{}, used = size_t(0), &env, name = name](Stats &stats) mutable {
+            if (out.empty())
+                out.resize(read_size(fd));
+
+            while (true)
+            {
+                // Read straight into the string, growing it geometrically, before a read could
+                // cut a packet short, which drops the rest of it
+                if (out.size() - used < PIPE_BUF)
+                    out.resize(std::max(out.size() * 2, used + PIPE_BUF));
+
+                ssize_t count = ::read(fd, &out[used], out.size() - used);
+                if (count < 0)
+                {
+                    if (errno == EAGAIN)
+                        return false;
+                    stats.ret = errno;
+                    return true;
+                }
+                else if (count == 0)
+                    break;
+
+                used += count;
+            }
+            stats.bytes = used;
+            out.resize(used);
+            if (out.capacity() - used > 64 * 1024)
+                out.shrink_to_fit();
+
+            // Remove trailing newline
+            if (!out.empty() && out.at(out.length() - 1) == '\n')
+                out.erase(out.length() - 1);
+
+            // An already exported variable stays exported
+            env.set(name, std::move(out));
+            return true;
+        },
+        str
+    ));
+}
+
+subprocess sink(const Sink::Callback &callback, size_t buffer)
+{
+    return subprocess(new Sink(callback, buffer, false));
+}
+
+subprocess lines(const Sink::Callback &callback, size_t buffer)
+{
+    return subprocess(new Sink(callback, buffer, true));
+}
+
+Sink::Sink(const Callback &callback, size_t buffer, bool split) :
+    callback(callback),
+    buffer(buffer ? buffer : 1),
+    split(split)
+{
+}
+
+StreamFlags Sink::get_flags() const
+{
+    return {.in = StreamFlags::Create | StreamFlags::Accept, .out = StreamFlags::Ignore, .err = StreamFlags::Ignore};
+}
+
+subprocess Sink::copy() const
+{
+    return subprocess(new Sink(callback, buffer, split));
+}
+
+runsubprocess Sink::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+    int fds[2];
+    open_pipe(str.in, fds, true, env.pipe_options);
+
+    return runsubprocess(new RunThread(
+        env,
+        split ? "lines" : "sink",
+        fds[0],
+        Executor::Readable,
+        [fd = fds[0], callback = callback, split = split, buffer = buffer, buf = string(buffer, '\0'),
+         used = size_t(0)](Stats &stats) mutable {
+            while (true)
+            {
+                // Room for a whole packet, a read cutting one short drops the rest of it
+                if (buf.size() - used < PIPE_BUF)
+                    buf.resize(used + PIPE_BUF);
+
+                ssize_t count = ::read(fd, &buf[used], buf.size() - used);
+                if (count < 0)
+                {
+                    if (errno == EAGAIN)
+                        return false;
+                    stats.ret = errno;
+                    return true;
+                }
+                stats.bytes += count;
+
+                if (!split)
+                {
+                    if (count == 0)
+                        return true;
+                    for (size_t done = 0; done < size_t(count); done += buffer)
+                    {
+                        if (!callback(std::string_view(buf.data() + done, std::min(buffer, count - done))))
+                            return true;
+                    }
+                    continue;
+                }
+
+                // Pass on the complete lines, the rest waits at the start of the buffer
+                std::string_view data(buf.data(), used + count);
+                size_t begin = 0;
+                for (size_t end; (end = data.find('\n', std::max(begin, used))) != data.npos; begin = end + 1)
+                {
+                    // A line longer than the buffer goes in pieces of its size
+                    for (; end - begin >= buffer; begin += buffer)
+                    {
+                        if (!callback(data.substr(begin, buffer)))
+                            return true;
+                    }
+                    if (!callback(data.substr(begin, end - begin)))
+                        return true;
+                }
+                used = data.size() - begin;
+                for (; used >= buffer; begin += buffer, used -= buffer)
+                {
+                    if (!callback(data.substr(begin, buffer)))
+                        return true;
+                }
+                if (count == 0)
+                {
+                    // The end of the output, the last line has no newline
+                    if (used > 0)
+                        callback(data.substr(begin));
+                    return true;
+                }
+                if (begin > 0)
+                    memmove(buf.data(), buf.data() + begin, used);
+            }
+        },
+        str
+    ));
+}
+
+Filter::Filter(const string &name, const vector<gettable> &args, const Factory &factory, bool pure) :
+    name(name),
+    args(args),
+    factory(factory),
+    pure(pure)
+{
+}
+
+StreamFlags Filter::get_flags() const
+{
+    return {
+        .in = StreamFlags::Create | StreamFlags::Accept,
+        .out = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
+        .err = StreamFlags::Ignore
+    };
+}
+
+void Filter::get_variables(Variables &vars) const
+{
+    for (const gettable &arg : args)
+        arg->get_variables(vars.reads);
+}
+
+bool Filter::has_output(bool input) const
+{
+    return input && pure;
+}
+
+// The steps of a Filter over the whole input as a single piece
+static string filter_string(const Filter::Step &factory_step, std::string_view in)
+{
+    Filter::Step step = factory_step;
+    string out{};
+    if (step(in, out) && !in.empty())
+        step(std::string_view{}, out);
+    return out;
+}
+
+string Filter::get_output(const Environment &env, const string *in) const
+{
+    vector<string> values{};
+    for (const gettable &arg : args)
+        values.push_back(arg->get(env));
+    return filter_string(factory(values), *in);
+}
+
+bool Filter::takes_input() const
+{
+    return pure;
+}
+
+runsubprocess Filter::start_with(string &&in, Streams str, const Environment &env) const
+{
+    if (!check_stream(str.out, get_flags().out))
+        throw std::invalid_argument("Wrong file descriptor option for stdout");
+
+    string output = get_output(env, &in);
+    if (str.out == Streams::None)
+    {
+        auto running = new RunEmpty(str, 0, name);
+        running->record.bytes = in.size();
+        return runsubprocess(running);
+    }
+    auto hold = std::make_shared<const string>(std::move(output));
+    return Echo::write(str, env, {std::string_view(*hold)}, {hold});
+}
+
+subprocess Filter::copy() const
+{
+    return subprocess(new Filter(name, args, factory, pure));
+}
+
+runsubprocess Filter::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+
+    vector<string> values{};
+    string title = name;
+    for (const gettable &arg : args)
+    {
+        values.push_back(arg->get(env));
+        title += " " + values.back();
+    }
+    // Made before the pipes, so a failing tee() leaks nothing
+    Step step = factory(values);
+    ignore_sigpipe();
+
+    // Without a stdout the output is dropped, e.g. at the end of cmd | tee(path)
+    int in[2], out[2] = {Streams::None, Streams::None};
+    open_pipe(str.in, in, true, env.pipe_options);
+    open_pipe(str.out, out, false, env.pipe_options);
+
+    return runsubprocess(new RunThread(
+        env,
+        title,
+        [in = in[0], out = out[1], step = std::move(step)](RunThread &, Stats &stats) mutable {
+            const size_t bufsz = 64 * 1024;
+            std::unique_ptr<char[]> buffer(new char[bufsz]);
+            string output{};
+            for (bool more = true; more;)
+            {
+                ssize_t count = ::read(in, buffer.get(), bufsz);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    stats.ret = errno;
+                    break;
+                }
+                stats.bytes += count;
+
+                output.clear();
+                try
+                {
+                    more = step(std::string_view(buffer.get(), count), output) && count > 0;
+                }
+                catch (const std::system_error &e)
+                {
+                    // e.g. tee() failing to write its file, the filter returns the error
+                    stats.ret = e.code().value();
+                    break;
+                }
+                for (size_t done = 0; out != Streams::None && done < output.size();)
+                {
+                    struct iovec iov
+                    {
+                        output.data() + done, output.size() - done
+                    };
+                    ssize_t written = ::writev(out, &iov, 1);
+                    if (written < 0 && errno != EINTR)
+                    {
+                        stats.ret = errno;
+                        more = false;
+                        break;
+                    }
+                    done += std::max<ssize_t>(written, 0);
+                }
+            }
+            close(in);
+            close_pipe(out);
+        },
+        str
+    ));
+}
+
+// Passes the complete lines of the input with their newline to a callback, which returns false to stop,
+// the last line may have no newline, only a line split across pieces is copied
+class LineSplitter
+{
+    string partial;
+
+  public:
+    template <typename F>
+    bool feed(std::string_view in, F &&line)
+    {
+        if (in.empty())
+            return partial.empty() || line(std::string_view(partial));
+
+        const char *begin = in.data(), *end = begin + in.size();
+        while (begin < end)
+        {
+            const char *nl = static_cast<const char *>(memchr(begin, '\n', end - begin));
+            if (!nl)
+            {
+                partial.append(begin, end);
+                return true;
+            }
+            std::string_view piece(begin, nl + 1 - begin);
+            begin = nl + 1;
+            if (!partial.empty())
+            {
+                partial.append(piece);
+                bool more = line(std::string_view(partial));
+                partial.clear();
+                if (!more)
+                    return false;
+            }
+            else if (!line(piece))
+                return false;
+        }
+        return true;
+    }
+};
+
+subprocess head(size_t count)
+{
+    return subprocess(new Filter("head -n " + std::to_string(count), {}, [count](const vector<string> &) {
+        return [left = count](std::string_view in, string &out) mutable {
+            // Counting the newlines is all it takes, the lines are passed on as they came
+            size_t end = 0;
+            for (; left > 0 && end < in.size(); left--)
+            {
+                const void *nl = memchr(in.data() + end, '\n', in.size() - end);
+                end = nl ? static_cast<const char *>(nl) - in.data() + 1 : in.size();
+                if (!nl)
+                    left++; // The line goes on in the next piece
+            }
+            out.append(in.substr(0, end));
+            return left > 0;
+        };
+    }));
+}
+
+// Where the last count lines of data start
+static size_t last_lines(std::string_view data, size_t count)
+{
+    size_t end = data.size();
+    if (end > 0 && data[end - 1] == '\n')
+        end--;
+    for (; count > 0; count--)
+    {
+        const void *nl = memrchr(data.data(), '\n', end);
+        if (!nl)
+            return 0;
+        end = static_cast<const char *>(nl) - data.data();
+    }
+    return end + 1;
+}
+
+subprocess tail(size_t count)
+{
+    return subprocess(new Filter("tail -n " + std::to_string(count), {}, [count](const vector<string> &) {
+        return [count, kept = string{}, bound = size_t(64 * 1024)](std::string_view in, string &out) mutable {
+            if (count == 0)
+                return false;
+            kept.append(in);
+            if (!in.empty() && kept.size() < bound)
+                return true;
+
+            // Drop what's before the last lines, at most as often as the kept lines double
+            kept.erase(0, last_lines(kept, count));
+            bound = std::max(bound, kept.size() * 2);
+            if (in.empty())
+                out.append(kept);
+            return true;
+        };
+    }));
+}
+
+subprocess cut(char delimiter, size_t field)
+{
+    string name = "cut -d" + string(1, delimiter) + " -f" + std::to_string(field);
+    return subprocess(new Filter(name, {}, [delimiter, field](const vector<string> &) {
+        return [delimiter, field, lines = LineSplitter{}](std::string_view in, string &out) mutable {
+            return lines.feed(in, [&](std::string_view line) {
+                bool newline = line.back() == '\n';
+                std::string_view rest = newline ? line.substr(0, line.size() - 1) : line;
+                if (rest.find(delimiter) != rest.npos)
+                {
+                    // Skip the fields before, with as many delimiters
+                    for (size_t k = 1; k < field; k++)
+                    {
+                        size_t next = rest.find(delimiter);
+                        rest = next == rest.npos ? std::string_view{} : rest.substr(next + 1);
+                    }
+                    rest = rest.substr(0, rest.find(delimiter));
+                }
+                out.append(rest);
+                out.push_back('\n');
+                return true;
+            });
+        };
+    }));
+}
+
+subprocess wc(int count)
+{
+    return subprocess(new Filter("wc", {}, [count](const vector<string> &) {
+        return [count, lines = size_t(0), words = size_t(0), bytes = size_t(0),
+                word = false](std::string_view in, string &out) mutable {
+            bytes += in.size();
+            if ((count & Filter::Lines) && !in.empty())
+            {
+                // memchr scans with vector instructions, a loop over the bytes doesn't
+                const char *p = in.data(), *end = p + in.size();
+                while ((p = static_cast<const char *>(memchr(p, '\n', end - p))))
+                {
+                    lines++;
+                    p++;
+                }
+            }
+            if (count & Filter::Words)
+            {
+                for (char c : in)
+                {
+                    bool space = c == ' ' || (c >= '\t' && c <= '\r');
+                    words += word && space;
+                    word = !space;
+                }
+            }
+            if (!in.empty())
+                return true;
+
+            words += word;
+            vector<size_t> counts{};
+            if (count & Filter::Lines)
+                counts.push_back(lines);
+            if (count & Filter::Words)
+                counts.push_back(words);
+            if (count & Filter::Bytes)
+                counts.push_back(bytes);
+            for (size_t i = 0; i < counts.size(); i++)
+                out += (i ? " " : "") + std::to_string(counts[i]);
+            out.push_back('\n');
+            return true;
+        };
+    }));
+}
+
+Filter::Factory Filter::grep_factory(bool invert)
+{
+    return [invert](const vector<string> &args) {
+        return [text = args[0], invert, lines = LineSplitter{}](std::string_view in, string &out) mutable {
+            return lines.feed(in, [&](std::string_view line) {
+                if ((line.find(text) != line.npos) != invert)
+                    out.append(line);
+                return true;
+            });
+        };
+    };
+}
+
+Filter::Factory Filter::tee_factory(bool append)
+{
+    return [append](const vector<string> &args) {
+        int fd = ::open(
+            args[0].c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+        );
+        if (fd < 0)
+            throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+        // Shared by the copies std::function makes, the last one closes the file
+        std::shared_ptr<int> file(new int(fd), [](int *fd) {
+            close(*fd);
+            delete fd;
+        });
+        return [file](std::string_view in, string &out) {
+            for (size_t done = 0; done < in.size();)
+            {
+                ssize_t written = ::write(*file, in.data() + done, in.size() - done);
+                if (written < 0 && errno != EINTR)
+                    throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+                done += std::max<ssize_t>(written, 0);
+            }
+            out.append(in);
+            return true;
+        };
+    };
+}
+
+// Moves exactly size bytes out of the pipe in to out, size is what's left when it fails, returns 0 or errno
+static int move_piece(int in, int out, size_t &size)
+{
+    while (size > 0)
+    {
+        ssize_t count = splice(in, nullptr, out, nullptr, size, SPLICE_F_MOVE);
+        if (count < 0 && errno == EINVAL)
+        {
+            // splice refuses some files, e.g. ones opened with O_APPEND
+            char buffer[16 * 1024];
+            count = ::read(in, buffer, std::min(size, sizeof(buffer)));
+            for (ssize_t done = 0; done < count;)
+            {
+                ssize_t ret = ::write(out, buffer + done, count - done);
+                if (ret < 0 && errno != EINTR)
+                {
+                    size -= count;
+                    return errno;
+                }
+                done += std::max<ssize_t>(ret, 0);
+            }
+        }
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (count == 0)
+            return EIO;
+        size -= count;
+    }
+    return 0;
+}
+
+// Gives target the size bytes in the pipe piece without consuming them, returns 0 or errno
+// A full target can take only part of it and tee(2) always starts at the beginning, so the rest,
+// or all of it for a target that isn't a pipe, goes from a copy in rest, an empty pipe as large as piece
+static int tee_piece(int piece, const int rest[2], int null, int target, size_t size)
+{
+    ssize_t done;
+    do
+        done = ::tee(piece, target, size, 0);
+    while (done < 0 && errno == EINTR);
+    if (done == ssize_t(size))
+        return 0;
+    if (done < 0 && errno != EINVAL)
+        return errno;
+
+    ssize_t copied;
+    do
+        copied = ::tee(piece, rest[1], size, 0);
+    while (copied < 0 && errno == EINTR);
+    if (copied != ssize_t(size))
+        return copied < 0 ? errno : EIO;
+
+    size_t skip = std::max<ssize_t>(done, 0);
+    size_t left = size - skip;
+    int err = move_piece(rest[0], null, skip);
+    if (!err)
+        err = move_piece(rest[0], target, left);
+    if (err)
+    {
+        // Dropped, so rest is empty for the next target
+        left += skip;
+        move_piece(rest[0], null, left);
+    }
+    return err;
+}
+
+// Copies everything from in to every target and to sink, which may be None, returns 0 or errno
+// Every piece is moved into a pipe of its own, the targets get it with tee(2), which only references
+// its pages, and the sink consumes it with splice, so the data is never copied through userspace
+// A target whose reader is gone is closed and dropped, like the sink, which a target then replaces
+static int fanout_fds(int in, vector<int> &targets, int &sink, size_t &bytes)
+{
+    int piece[2], rest[2];
+    if (::pipe2(piece, O_CLOEXEC))
+        return errno;
+    if (::pipe2(rest, O_CLOEXEC))
+    {
+        int err = errno;
+        close(piece[0]);
+        close(piece[1]);
+        return err;
+    }
+    int null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    // A piece is as large as the input pipe allows, rest must hold all of it
+    int capacity = fcntl(in, F_GETPIPE_SZ);
+    if (capacity > 0 && fcntl(rest[0], F_SETPIPE_SZ, capacity) >= 0)
+        fcntl(piece[0], F_SETPIPE_SZ, capacity);
+
+    int ret = null < 0 ? errno : 0;
+    while (!ret && (sink != Streams::None || !targets.empty()))
+    {
+        if (sink == Streams::None)
+        {
+            sink = targets.back();
+            targets.pop_back();
+        }
+
+        ssize_t count = splice(in, nullptr, piece[1], nullptr, 1 << 30, SPLICE_F_MOVE);
+        if (count < 0)
+        {
+            if (errno != EINTR)
+                ret = errno;
+            continue;
+        }
+        if (count == 0)
+            break;
+        bytes += count;
+
+        for (size_t i = 0; !ret && i < targets.size();)
+        {
+            int err = tee_piece(piece[0], rest, null, targets[i], count);
+            if (err == EPIPE)
+            {
+                close(targets[i]);
+                targets.erase(targets.begin() + i);
+            }
+            else
+            {
+                ret = err;
+                i++;
+            }
+        }
+
+        size_t left = count;
+        int err = move_piece(piece[0], sink, left);
+        if (err == EPIPE)
+        {
+            close(sink);
+            sink = Streams::None;
+            err = move_piece(piece[0], null, left);
+        }
+        if (!ret)
+            ret = err;
+    }
+
+    close(piece[0]);
+    close(piece[1]);
+    close(rest[0]);
+    close(rest[1]);
+    close_pipe(null);
+    return ret;
+}
+
+Fanout::Fanout(const vector<subprocess> &outputs) :
+    outputs(outputs)
+{
+}
+
+StreamFlags Fanout::get_flags() const
+{
+    return {
+        .in = StreamFlags::Create | StreamFlags::Accept,
+        .out = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
+        .err = StreamFlags::Ignore
+    };
 }
 
-StreamFlags Pipe::get_flags() const
+void Fanout::get_variables(Variables &vars) const
 {
-    return {.in = lhs->get_flags().in, .out = rhs->get_flags().out, .err = rhs->get_flags().out};
+    for (const subprocess &output : outputs)
+        output->get_variables(vars);
 }
 
-runsubprocess Pipe::start(Streams str, const Environment &env) const
+subprocess Fanout::copy() const
 {
-    return start<const Environment &>(str, env);
+    return subprocess(new Fanout(outputs));
 }
 
-runsubprocess Pipe::start(Streams str, Environment &env) const
+template <typename E>
+runsubprocess Fanout::start(Streams str, E env) const
 {
-    return start<Environment &>(str, env);
-}
+    check_streams(str);
+    ignore_sigpipe();
 
-RunPipe::RunPipe(runsubprocess &&lhs, runsubprocess &&rhs) :
-    lhs(std::move(lhs)),
-    rhs(std::move(rhs))
-{
+    // The outputs are started first, each reading its own pipe
+    vector<int> targets{};
+    runsubprocess outputs_p;
+    try
+    {
+        for (const subprocess &output : outputs)
+        {
+            StreamFlags flags = output->get_flags();
+            runsubprocess output_p;
+            if (flags.in & StreamFlags::Accept)
+            {
+                int fds[2];
+                Pipe::create(fds, env.pipe_options);
+                targets.push_back(fds[1]);
+                output_p = output->start({.in = fds[0]}, env);
+            }
+            else if (flags.in & StreamFlags::Create)
+            {
+                output_p = output->start({.in = Streams::New}, env);
+                targets.push_back(output_p->get_streams().in);
+            }
+            else
+            {
+                throw std::invalid_argument("Fanout output doesn't read stdin");
+            }
+
+            if (outputs_p)
+                outputs_p = runsubprocess(new RunPipe(std::move(outputs_p), std::move(output_p), {}, "fanout"));
+            else
+                outputs_p = std::move(output_p);
+        }
+    }
+    catch (...)
+    {
+        // The started outputs get EOF
+        for (int fd : targets)
+            close(fd);
+        throw;
+    }
+
+    int in[2], out[2] = {Streams::None, Streams::None};
+    open_pipe(str.in, in, true, env.pipe_options);
+    open_pipe(str.out, out, false, env.pipe_options);
+
+    runsubprocess copier(new RunThread(
+        env,
+        "fanout",
+        [in = in[0], out = out[1], targets = std::move(targets)](RunThread &, Stats &stats) mutable {
+            int sink = out;
+            stats.ret = fanout_fds(in, targets, sink, stats.bytes);
+            close(in);
+            close_pipe(sink);
+            for (int fd : targets)
+                close(fd);
+        },
+        str
+    ));
+    if (!outputs_p)
+        return copier;
+    return runsubprocess(new RunPipe(std::move(copier), std::move(outputs_p), str, "fanout"));
 }
 
-Streams RunPipe::get_streams() const
+runsubprocess Fanout::start(Streams str, const Environment &env) const
 {
-    return {.in = lhs->get_streams().in, .out = rhs->get_streams().out, .err = rhs->get_streams().err};
+    return start<const Environment &>(str, env);
 }
 
-int RunPipe::wait()
+runsubprocess Fanout::start(Streams str, Environment &env) const
 {
-    return lhs->wait() | rhs->wait();
+    return start<Environment &>(str, env);
 }
 
-Exec::Exec(const vector<gettable> &a) :
-    argv(a)
+Cached::Cached(const subprocess &sub, Stats::clock::duration ttl, const vector<string> &files,
+               const std::shared_ptr<Cache> &cache) :
+    sub(sub),
+    ttl(ttl),
+    files(files),
+    cache(cache)
 {
+    Variables vars{};
+    sub->get_variables(vars);
+    std::sort(vars.reads.begin(), vars.reads.end());
+    vars.reads.erase(std::unique(vars.reads.begin(), vars.reads.end()), vars.reads.end());
+    reads = std::move(vars.reads);
+    std::sort(vars.writes.begin(), vars.writes.end());
+    vars.writes.erase(std::unique(vars.writes.begin(), vars.writes.end()), vars.writes.end());
+    writes = std::move(vars.writes);
+    exports = vars.exports;
 }
 
-StreamFlags Exec::get_flags() const
+StreamFlags Cached::get_flags() const
 {
+    StreamFlags flags = sub->get_flags();
     return {
-        .in = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
-        .out = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore,
-        .err = StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore
+        .in = StreamFlags::Ignore,
+        .out = (flags.out & (StreamFlags::Create | StreamFlags::Accept))
+                   ? StreamFlags::Create | StreamFlags::Accept | StreamFlags::Ignore
+                   : StreamFlags::Ignore,
+        .err = flags.err & (StreamFlags::Ignore | StreamFlags::Accept)
     };
 }
 
-bool Subprocess::check_stream(int stream, int flag)
+void Cached::get_variables(Variables &vars) const
 {
-    return (stream == Streams::None && (flag & StreamFlags::Ignore)) ||
-           (stream == Streams::New && (flag & StreamFlags::Create)) || (stream >= 0 && (flag & StreamFlags::Accept));
+    sub->get_variables(vars);
 }
 
-void Subprocess::check_streams(Streams streams) const
+subprocess Cached::copy() const
 {
-    StreamFlags flags = get_flags();
-    if (!check_stream(streams.in, flags.in))
-        throw std::invalid_argument("Wrong file descriptor option for stdin");
-    if (!check_stream(streams.out, flags.out))
-        throw std::invalid_argument("Wrong file descriptor option for stdout");
-    if (!check_stream(streams.err, flags.err))
-        throw std::invalid_argument("Wrong file descriptor option for stderr");
+    return subprocess(new Cached(sub, ttl, files, cache));
 }
 
-static void open_pipe(int &str, int fds[2], bool input)
+string Cached::key(const Environment &env) const
 {
-    if (str != Streams::None)
+    // Every field is prefixed with its size, so no two different inputs make the same key
+    string key{};
+    auto field = [&key](std::string_view value) {
+        key.append(std::to_string(value.size())).push_back(':');
+        key.append(value);
+    };
+
+    // The same arguments in another directory are another command
+    std::unique_ptr<char, decltype(&free)> cwd(getcwd(nullptr, 0), &free);
+    field(cwd ? cwd.get() : "");
+
+    std::shared_ptr<const Environment::Vars> vars = env.snapshot();
+    for (const string &name : reads)
     {
-        if (str == Streams::New)
-        {
-            if (::pipe2(fds, O_CLOEXEC))
-            {
-                throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
-            };
-            str = fds[input ? 1 : 0];
-        }
-        else
+        field(name);
+        const Environment::Var *var = vars->find(name);
+        key.push_back(var ? '=' : '-');
+        if (var)
+            field(var->first);
+    }
+
+    if (exports)
+    {
+        key.push_back('e');
+        for (const string &var : env.envp()->vars)
+            field(var);
+    }
+
+    for (const string &path : files)
+    {
+        field(path);
+        struct stat st;
+        if (::stat(path.c_str(), &st))
         {
-            fds[input ? 0 : 1] = str;
+            key.push_back('-');
+            continue;
         }
+        field(std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + " " +
+              std::to_string(st.st_size) + " " + std::to_string(st.st_ino));
     }
+    return key;
 }
 
-static void close_pipe(int fd)
-{
-    if (fd != Streams::None)
-        close(fd);
-}
-
-runsubprocess Exec::start(Streams str, const Environment &env) const
+template <typename E>
+runsubprocess Cached::start(Streams str, E env) const
 {
     check_streams(str);
-    int fds[3][2];
-    memset(fds, Streams::None, sizeof(fds));
-
-    open_pipe(str.in, fds[STDIN_FILENO], true);
-    open_pipe(str.out, fds[STDOUT_FILENO], false);
-    open_pipe(str.err, fds[STDERR_FILENO], false);
-
-    pid_t pid = fork();
-    if (pid == 0)
-    { // child
-        close_pipe(fds[STDIN_FILENO][1]);
-        close_pipe(fds[STDOUT_FILENO][0]);
-        close_pipe(fds[STDERR_FILENO][0]);
-
-        if (fds[STDIN_FILENO][0] != Streams::None)
-            dup2(fds[STDIN_FILENO][0], STDIN_FILENO);
-        if (fds[STDOUT_FILENO][1] != Streams::None)
-            dup2(fds[STDOUT_FILENO][1], STDOUT_FILENO);
-        if (fds[STDERR_FILENO][1] != Streams::None)
-            dup2(fds[STDERR_FILENO][1], STDERR_FILENO);
+    string id = key(env);
 
-        vector<char *> c_argv{};
-        c_argv.reserve(argv.size() + 1);
+    std::optional<Entry> hit;
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto found = cache->entries.find(id);
+        if (found != cache->entries.end() && found->second.expires > Stats::clock::now())
+            hit = found->second;
+    }
 
-        for (auto &s : argv)
+    if (hit)
+    {
+        if constexpr (std::is_const_v<std::remove_reference_t<E>>)
         {
-            // The allocated strings will be freed once the child dies
-            c_argv.push_back(strdup(s->get(env).c_str()));
+            if (!writes.empty())
+                throw std::invalid_argument("Can't create variable in const Environment");
+        }
+        else
+        {
+            for (auto &[name, value] : hit->vars)
+                env.set(name, std::move(value));
         }
-        c_argv.push_back(NULL);
 
-        // Const casting here is safe, execve guarantees the arguments not to be changed in any way
-        execvpe(c_argv[0], c_argv.data(), const_cast<char *const *>(env.envp().data()));
-        exit(errno);
-    }
-    else if (pid < 0)
-    { // error
-        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+        // Nothing is started, stderr gets nothing
+        if (str.err >= 0)
+            close(str.err);
+        str.err = Streams::None;
+        int ret = hit->ret;
+        if (str.out == Streams::None)
+            return runsubprocess(new RunEmpty(str, ret, "cached"));
+        return runsubprocess(new RunFinish(Pipe::write(env, std::move(hit->output), str.out), [ret](int written) {
+            return written ? written : ret;
+        }));
     }
-    else
-    { // parent
-        close_pipe(fds[STDIN_FILENO][0]);
-        close_pipe(fds[STDOUT_FILENO][1]);
-        close_pipe(fds[STDERR_FILENO][1]);
 
-        return runsubprocess(new RunExec(pid, str));
+    // Started with a pipe of its own, the output is kept while it's copied to stdout
+    int flags = sub->get_flags().out;
+    int source[2] = {Streams::None, Streams::None};
+    if (!(flags & StreamFlags::Create) && (flags & StreamFlags::Accept))
+        Pipe::create(source, env.pipe_options);
+    runsubprocess sub_p;
+    try
+    {
+        sub_p = sub->start({.in = Streams::None, .out = (flags & StreamFlags::Create) ? Streams::New : source[1],
+                            .err = str.err},
+                           env);
+    }
+    catch (...)
+    {
+        close_pipe(source[0]);
+        throw;
     }
+    if (source[0] == Streams::None)
+        source[0] = sub_p->get_streams().out;
+
+    // What sub set is kept with its output, a read() at its end leaves no output at all
+    auto entry = [cache = cache, id = std::move(id), ttl = ttl, writes = writes, &env](int ret, string &&output) {
+        Entry entry{.output = std::move(output), .vars = {}, .ret = ret, .expires = Stats::clock::now() + ttl};
+        std::shared_ptr<const Environment::Vars> vars = env.snapshot();
+        for (const string &name : writes)
+            if (const Environment::Var *var = vars->find(name))
+                entry.vars.emplace_back(name, string(var->first));
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        std::erase_if(cache->entries, [now = Stats::clock::now()](const auto &entry) {
+            return entry.second.expires <= now;
+        });
+        cache->entries[id] = std::move(entry);
+        return ret;
+    };
+    // Only a normal exit is stored, not a run that was cancelled or had a child killed by a signal
+    auto store = [](runsubprocess &&inner, std::function<int(int)> &&stored) {
+        auto running = new RunFinish(std::move(inner), nullptr);
+        running->finish = [running, stored = std::move(stored)](int ret) {
+            return running->cancelled || running->inner->stats().signal ? ret : stored(ret);
+        };
+        return runsubprocess(running);
+    };
+    if (source[0] == Streams::None)
+        return store(std::move(sub_p), [entry](int ret) { return entry(ret, string()); });
+
+    int out[2] = {Streams::None, Streams::None};
+    open_pipe(str.out, out, false, env.pipe_options);
+    ignore_sigpipe();
+
+    struct Output
+    {
+        string data;
+        bool complete = false;
+    };
+    auto output = std::make_shared<Output>();
+    runsubprocess capture(new RunThread(
+        env,
+        "capture",
+        [in = source[0], out = out[1], output](RunThread &, Stats &stats) {
+            const size_t bufsz = 64 * 1024;
+            std::unique_ptr<char[]> buffer(new char[bufsz]);
+            // A reader that's gone stops the copy but not the capture
+            int target = out;
+            while (true)
+            {
+                ssize_t count = ::read(in, buffer.get(), bufsz);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                {
+                    output->complete = count == 0;
+                    break;
+                }
+                output->data.append(buffer.get(), count);
+                stats.bytes += count;
+                for (ssize_t done = 0; target != Streams::None && done < count;)
+                {
+                    ssize_t written = ::write(target, buffer.get() + done, count - done);
+                    if (written < 0 && errno != EINTR)
+                        target = Streams::None;
+                    done += std::max<ssize_t>(written, 0);
+                }
+            }
+            close(in);
+            close_pipe(out);
+        },
+        {.out = str.out}
+    ));
+
+    Streams streams{.in = Streams::None, .out = str.out, .err = sub_p->get_streams().err};
+    runsubprocess both(new RunPipe(std::move(sub_p), std::move(capture), streams, "cached"));
+    return store(std::move(both), [entry, output](int ret) {
+        return output->complete ? entry(ret, std::move(output->data)) : ret;
+    });
 }
 
-subprocess Exec::copy() const
+runsubprocess Cached::start(Streams str, const Environment &env) const
 {
-    return subprocess(new Exec(argv));
+    return start<const Environment &>(str, env);
 }
 
-RunExec::RunExec(pid_t pid, Streams streams) :
-    pid(pid),
-    streams(streams)
+runsubprocess Cached::start(Streams str, Environment &env) const
 {
+    return start<Environment &>(str, env);
 }
 
-int RunExec::wait()
+Profiled::Profiled(const subprocess &sub, const LaunchOptions &options) :
+    sub(sub),
+    options(Environment::checked(options))
 {
-    siginfo_t siginfo;
-    if (waitid(P_PID, pid, &siginfo, WEXITED | WSTOPPED))
-        return -1;
-    return siginfo.si_status;
 }
 
-Streams RunExec::get_streams() const
+StreamFlags Profiled::get_flags() const
 {
-    return streams;
+    return sub->get_flags();
 }
 
-Or::Or(const subprocess &lhs, const subprocess &rhs) :
-    lhs(lhs->copy()),
-    rhs(rhs->copy())
+void Profiled::get_variables(Variables &vars) const
 {
+    sub->get_variables(vars);
 }
 
-subprocess Or::copy() const
+bool Profiled::has_output(bool input) const
 {
-    return subprocess(new Or(lhs, rhs));
+    return sub->has_output(input);
 }
 
-runsubprocess Or::start(Streams str, const Environment &env) const
+string Profiled::get_output(const Environment &env, const string *in) const
 {
-    check_streams(str);
-    return runsubprocess(
-        new RunThread([&lhs = lhs, &rhs = rhs, &env](int &ret) { ret = !(!run(lhs, env) || !run(rhs, env)); }, str)
-    );
+    return sub->get_output(env, in);
 }
 
-runsubprocess Or::start(Streams str, Environment &env) const
+void Profiled::output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
 {
-    check_streams(str);
-    return runsubprocess(
-        new RunThread([&lhs = lhs, &rhs = rhs, &env](int &ret) { ret = !(!run(lhs, env) || !run(rhs, env)); }, str)
-    );
+    sub->output_pieces(env, out, hold);
 }
 
-And::And(const subprocess &lhs, const subprocess &rhs) :
-    lhs(lhs->copy()),
-    rhs(rhs->copy())
+subprocess Profiled::copy() const
 {
+    return subprocess(new Profiled(sub, options));
 }
 
-subprocess And::copy() const
+runsubprocess Profiled::start(Streams str, const Environment &env) const
 {
-    return subprocess(new And(lhs, rhs));
+    // The builtins of the run refer to the copy, so it lives as long as the run
+    auto profiled = std::make_shared<Environment>(env);
+    profiled->launch_options = options;
+    runsubprocess running = sub->start(str, static_cast<const Environment &>(*profiled));
+    return runsubprocess(new RunFinish(std::move(running), [profiled](int ret) { return ret; }));
 }
 
-runsubprocess And::start(Streams str, const Environment &env) const
+runsubprocess Profiled::start(Streams str, Environment &env) const
 {
-    check_streams(str);
-    return runsubprocess(
-        new RunThread([&lhs = lhs, &rhs = rhs, &env](int &ret) { ret = !(!run(lhs, env) && !run(rhs, env)); }, str)
-    );
+    // The copy only differs in the options, what the run sets in it is set in env once it's finished
+    auto profiled = std::make_shared<Environment>(env);
+    profiled->launch_options = options;
+    Variables vars{};
+    sub->get_variables(vars);
+    runsubprocess running = sub->start(str, *profiled);
+    return runsubprocess(new RunFinish(std::move(running), [profiled, &env, writes = std::move(vars.writes)](int ret) {
+        std::shared_ptr<const Environment::Vars> set = profiled->snapshot();
+        for (const string &name : writes)
+        {
+            if (const Environment::Var *var = set->find(name))
+                env.set(name, string(var->first));
+        }
+        return ret;
+    }));
 }
 
-runsubprocess And::start(Streams str, Environment &env) const
+RunFinish::RunFinish(runsubprocess &&inner, std::function<int(int)> &&finish) :
+    finish(std::move(finish)),
+    inner(std::move(inner)),
+    cancelled(0)
 {
-    check_streams(str);
-    return runsubprocess(
-        new RunThread([&lhs = lhs, &rhs = rhs, &env](int &ret) { ret = !(!run(lhs, env) && !run(rhs, env)); }, str)
-    );
 }
 
-RunThread::RunThread(std::function<void(int &)> &&fun, Streams str) :
-    ret(0),
-    thread(std::thread(std::move(fun), std::ref(ret))),
-    streams(str)
+Streams RunFinish::get_streams() const
 {
+    return inner->get_streams();
 }
-Streams RunThread::get_streams() const
+
+int RunFinish::wait()
 {
-    return streams;
+    return finish(inner->wait());
 }
-int RunThread::wait()
+
+void RunFinish::on_exit(Executor &executor, std::function<void(int)> &&done)
 {
-    thread.join();
-    return ret;
+    inner->on_exit(executor, [this, done = std::move(done)](int ret) { done(finish(ret)); });
 }
 
-Read::Read(const string &name) :
-    name(name)
+void RunFinish::cancel(int sig)
 {
+    cancelled = sig;
+    inner->cancel(sig);
 }
 
-StreamFlags Read::get_flags() const
+Stats RunFinish::stats() const
 {
-    return {.in = StreamFlags::Create | StreamFlags::Accept, .out = StreamFlags::Ignore, .err = StreamFlags::Ignore};
+    return inner->stats();
 }
 
-subprocess Read::copy() const
+Echo::Echo(const vector<gettable> &a) :
+    var(a)
 {
-    return subprocess(new Read(name));
 }
 
-runsubprocess Read::start(Streams str, const Environment &env) const
+StreamFlags Echo::get_flags() const
 {
-    throw std::invalid_argument("Can't create variable in const Environment");
+    return {.in = StreamFlags::Ignore, .out = StreamFlags::Create | StreamFlags::Accept, .err = StreamFlags::Ignore};
 }
 
-runsubprocess Read::start(Streams str, Environment &env) const
+void Echo::get_variables(Variables &vars) const
 {
-    check_streams(str);
-    int fds[2];
-    open_pipe(str.in, fds, true);
-
-    return runsubprocess(new RunThread(
-        [fds, &env, &name = name](int &ret) {
-            const size_t bufsz = 1000;
-            char buffer[bufsz];
-            string out{};
-            while (true)
-            {
-                ssize_t count = ::read(fds[0], buffer, bufsz);
-                if (count < 0)
-                {
-                    ret = errno;
-                    return;
-                }
-                else if (count == 0)
-                    break;
-
-                out.append(buffer, count);
-            }
-            close(fds[0]);
-            // Remove trailing newline
-            if (!out.empty() && out.at(out.length() - 1) == '\n')
-                out.erase(out.length() - 1);
+    for (const gettable &arg : var)
+        arg->get_variables(vars.reads);
+}
 
-            env.env[name] = {out, false};
-        },
-        str
-    ));
+bool Echo::has_output(bool input) const
+{
+    return true;
 }
 
-Echo::Echo(const vector<gettable> &a) :
-    var(a)
+string Echo::get_output(const Environment &env, const string *in) const
 {
+    vector<std::string_view> segs{};
+    holder hold{};
+    segments(var, env, segs, hold);
+    return join_pieces(segs);
 }
 
-StreamFlags Echo::get_flags() const
+void Echo::output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
 {
-    return {.in = StreamFlags::Ignore, .out = StreamFlags::Create | StreamFlags::Accept, .err = StreamFlags::Ignore};
+    segments(var, env, out, hold);
 }
 
 subprocess Echo::copy() const
@@ -471,55 +4686,121 @@ subprocess Echo::copy() const
     return subprocess(new Echo(var));
 }
 
+// The k-th piece of echo output: the arguments separated by spaces, then a newline
+void Echo::segments(const vector<gettable> &args, const Environment &env, vector<std::string_view> &out,
+                    holder &hold)
+{
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (i > 0)
+            out.push_back(" ");
+        args[i]->pieces(env, out, hold);
+    }
+    out.push_back("\n");
+}
+
 runsubprocess Echo::start(Streams str, const Environment &env) const
 {
     check_streams(str);
+
+    // The arguments are written from where they are, they are not copied
+    vector<std::string_view> segs{};
+    holder hold{};
+    segs.reserve(var.size() * 2);
+    segments(var, env, segs, hold);
+    return write(str, env, std::move(segs), std::move(hold));
+}
+
+runsubprocess Echo::write(Streams str, const Environment &env, vector<std::string_view> &&segments, holder &&hold)
+{
+    ignore_sigpipe();
     int fds[2];
-    open_pipe(str.out, fds, false);
+    open_pipe(str.out, fds, false, env.pipe_options);
 
     return runsubprocess(new RunThread(
-        [fds, &var = var, &env](int &ret) {
-            size_t i = 0;
-            for (const auto &gt : var)
+        env,
+        "echo",
+        fds[1],
+        Executor::Writable,
+        [fd = fds[1], segs = std::move(segments), hold = std::move(hold), seg = size_t(0),
+         offset = size_t(0)](Stats &stats) mutable {
+            while (seg < segs.size())
             {
-                string str = gt->get(env);
-                ssize_t count = 0;
-                while (true)
+                // All of the output in a single writev, unless there are more than IOV_MAX pieces
+                struct iovec iov[IOV_MAX];
+                int count = 0;
+                for (size_t k = seg; k < segs.size() && count < IOV_MAX; k++, count++)
                 {
-                    ssize_t ret = ::write(fds[1], &str[count], str.size() - count);
-                    if (ret < 0)
-                    {
-                        ret = errno;
-                        return;
-                    }
-                    else if (static_cast<size_t>(count += ret) == str.size())
+                    std::string_view piece = segs[k].substr(k == seg ? offset : 0);
+                    iov[count] = {const_cast<char *>(piece.data()), piece.size()};
+                }
+
+                ssize_t written = ::writev(fd, iov, count);
+                if (written < 0)
+                {
+                    if (errno == EAGAIN)
+                        return false;
+                    stats.ret = errno;
+                    return true;
+                }
+                stats.bytes += written;
+
+                for (size_t left = written; left > 0;)
+                {
+                    size_t piece = segs[seg].size() - offset;
+                    if (left < piece)
                     {
-                        if (++i != var.size() && ::write(fds[1], " ", 1) < 0)
-                        {
-                            ret = errno;
-                            return;
-                        }
+                        offset += left;
                         break;
                     }
+                    left -= piece;
+                    seg++;
+                    offset = 0;
+                }
+                // Skip empty arguments that were fully written
+                while (seg < segs.size() && segs[seg].size() == offset)
+                {
+                    seg++;
+                    offset = 0;
                 }
             }
-            if (::write(fds[1], "\n", 1) < 0)
-                ret = errno;
-            close(fds[1]);
+            return true;
         },
         str
     ));
 }
 
-RunEmpty::RunEmpty(Streams streams, int ret) :
+RunEmpty::RunEmpty(Streams streams, int ret, const string &name) :
     streams(streams),
-    ret(ret)
+    record{
+        .name = name,
+        .ret = ret,
+        .signal = 0,
+        .begin = Stats::clock::now(),
+        .spawn = {},
+        .wall = {},
+        .user = {},
+        .system = {},
+        .max_rss = 0,
+        .bytes = 0,
+        .children = {}
+    }
 {
 }
 
 int RunEmpty::wait()
 {
-    return ret;
+    return record.ret;
+}
+
+void RunEmpty::on_exit(Executor &executor, std::function<void(int)> &&done)
+{
+    done(record.ret);
+}
+
+Stats RunEmpty::stats() const
+{
+    return record;
 }
 
 Streams RunEmpty::get_streams() const
@@ -540,7 +4821,7 @@ subprocess True::copy() const
 runsubprocess True::start(Streams str, const Environment &env) const
 {
     check_streams(str);
-    return runsubprocess(new RunEmpty({}, 0));
+    return runsubprocess(new RunEmpty({}, 0, "true"));
 }
 
 subprocess False()
@@ -556,7 +4837,7 @@ subprocess False::copy() const
 runsubprocess False::start(Streams str, const Environment &env) const
 {
     check_streams(str);
-    return runsubprocess(new RunEmpty({}, -1));
+    return runsubprocess(new RunEmpty({}, -1, "false"));
 }
 
 File::File(const gettable &path, int mode) :
@@ -574,11 +4855,105 @@ StreamFlags File::get_flags() const
     };
 }
 
+void File::get_variables(Variables &vars) const
+{
+    path->get_variables(vars.reads);
+}
+
 subprocess File::copy() const
 {
     return subprocess(new File(path, mode));
 };
 
+Memory::Memory(const gettable &data) :
+    data(data)
+{
+}
+
+StreamFlags Memory::get_flags() const
+{
+    return {.in = StreamFlags::Ignore, .out = StreamFlags::Create, .err = StreamFlags::Ignore};
+}
+
+void Memory::get_variables(Variables &vars) const
+{
+    data->get_variables(vars.reads);
+}
+
+bool Memory::has_output(bool input) const
+{
+    return true;
+}
+
+string Memory::get_output(const Environment &env, const string *in) const
+{
+    vector<std::string_view> segs{};
+    holder hold{};
+    data->pieces(env, segs, hold);
+    segs.push_back("\n");
+    return join_pieces(segs);
+}
+
+void Memory::output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const
+{
+    data->pieces(env, out, hold);
+    out.push_back("\n");
+}
+
+subprocess Memory::copy() const
+{
+    return subprocess(new Memory(data));
+}
+
+runsubprocess Memory::start(Streams str, const Environment &env) const
+{
+    check_streams(str);
+    vector<std::string_view> segs{};
+    holder hold{};
+    data->pieces(env, segs, hold);
+    segs.push_back("\n");
+    return write(str, env, std::move(segs), std::move(hold), "memory");
+}
+
+runsubprocess Memory::write(
+    Streams str, const Environment &env, vector<std::string_view> &&segs, holder &&hold, const string &name
+)
+{
+    size_t total = 0;
+    for (std::string_view seg : segs)
+        total += seg.size();
+
+    // Fresh page cache pages cost more than a pipe reusing the same few, so large data is echoed,
+    // as is data for a given fd
+    if (total > max_size || str.out != Streams::New)
+        return Echo::write(str, env, std::move(segs), std::move(hold));
+
+    int fd = memfd_create("subprocess", MFD_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
+
+    // The data is copied once into the page cache, the reader then starts at offset 0
+    for (std::string_view seg : segs)
+    {
+        while (!seg.empty())
+        {
+            ssize_t count = ::write(fd, seg.data(), seg.size());
+            if (count < 0)
+            {
+                int err = errno;
+                close(fd);
+                throw std::system_error(std::error_code(err, std::system_category()), strerror(err));
+            }
+            seg.remove_prefix(count);
+        }
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    auto running = new RunEmpty({.in = Streams::None, .out = fd, .err = Streams::None}, 0, name);
+    running->record.bytes = total;
+    return runsubprocess(running);
+}
+
 runsubprocess File::start(Streams str, const Environment &env) const
 {
     check_streams(str);
@@ -591,7 +4966,8 @@ runsubprocess File::start(Streams str, const Environment &env) const
     else if (mode & File::Read)
         flags |= O_RDONLY;
 
-    int fd = ::open(path->get(env).c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    string name = path->get(env);
+    int fd = ::open(name.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
     if (fd < 0)
         throw std::system_error(std::error_code(errno, std::system_category()), strerror(errno));
@@ -602,7 +4978,7 @@ runsubprocess File::start(Streams str, const Environment &env) const
         .err = Streams::None
     };
 
-    return runsubprocess(new RunEmpty(streams, 0));
+    return runsubprocess(new RunEmpty(streams, 0, "open " + name));
 }
 
 namespace dev
@@ -6,19 +6,35 @@
 #include <memory>
 #include <thread>
 #include <functional>
-#include <map>
+#include <unordered_map>
+#include <string_view>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <coroutine>
+#include <memory_resource>
+#include <optional>
+#include <chrono>
 #include <stdexcept>
+#include <type_traits>
+#include <csignal>
+#include <sys/types.h>
+#include <sys/resource.h>
 
 namespace subprocess
 {
 using std::string;
 using std::vector;
 
-typedef std::unique_ptr<class Subprocess> subprocess;
+// Subprocesses are immutable once built, so composing them shares the operands instead of copying them
+typedef std::shared_ptr<const class Subprocess> subprocess;
 typedef std::unique_ptr<class RunSubprocess> runsubprocess;
 typedef std::shared_ptr<class Gettable> gettable;
 typedef vector<subprocess> script;
 typedef struct GettableVariable $;
+// Keeps alive the memory the views from Gettable::pieces() point to
+typedef vector<std::shared_ptr<const void>> holder;
 
 // Standard input, output and error file descriptors
 struct Streams
@@ -26,12 +42,39 @@ struct Streams
     static const int None = -1; // No fd for this stream
     static const int New = -2;  // The process needs to create it's own fd for this stream,
                                 // it can be retrieved using RunSubprocess::get_streams()
+    static const int Out = -3;  // Only for err, stderr goes wherever stdout goes, like 2>&1
 
     int in = None;
     int out = None;
     int err = None;
 };
 
+// Settings of the kernel pipes connecting subprocesses
+struct PipeOptions
+{
+    size_t capacity = 0; // Set with F_SETPIPE_SZ, 0 keeps the system default (64 KiB)
+    bool packet = false; // O_DIRECT packet mode, every write is read back separately
+};
+
+// How run() executes the steps of a script in parallel
+// A step starts once the earlier steps it depends on have succeeded, the dependencies
+// are the steps writing variables it reads or writes, reading variables it writes,
+// and, for steps starting children, writing exported variables
+struct ParallelOptions
+{
+    size_t jobs = 0;                           // Steps running at once, 0 is one per CPU
+    bool keep_going = false;                   // Keep starting steps after a failure, like make -k
+    vector<std::pair<size_t, size_t>> after{}; // Extra {step, dependency} pairs of step indices
+};
+
+// Environment variables a subprocess uses, see Subprocess::get_variables()
+struct Variables
+{
+    vector<string> reads;  // Read by it, e.g. the ${"var"} arguments
+    vector<string> writes; // Set by it, e.g. read("var")
+    bool exports = false;  // Starts children, which see the exported variables
+};
+
 // Process capabilites with regards to standard input, output and error
 // Each one can be a combination of the flags
 // These are checked against the provided Streams struct for compatiblity
@@ -46,35 +89,463 @@ struct StreamFlags
     int err = Ignore;
 };
 
+class Executor;
+class Cancellation;
+struct BatchResult;
+
+// Awaitable returned by RunSubprocess::async_wait(), resumes with the return code
+class ExitAwaitable
+{
+    friend class RunSubprocess;
+
+    RunSubprocess &sub;
+    Executor &executor;
+    int ret;
+
+    ExitAwaitable(RunSubprocess &sub, Executor &executor);
+
+  public:
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> handle);
+    int await_resume() const noexcept;
+};
+
+// Awaitable returned by async_read(), resumes with the data read, which is empty at the end of file
+class ReadAwaitable
+{
+    friend ReadAwaitable async_read(Executor &executor, int fd, size_t max);
+
+    Executor &executor;
+    int fd;
+    size_t max;
+    string data;
+    int err;
+
+    ReadAwaitable(Executor &executor, int fd, size_t max);
+
+  public:
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> handle);
+    string await_resume();
+};
+
+// While alive, RunSubprocess objects created on this thread are allocated from it,
+// run() uses one for every execution of a tree, so the whole run costs a single bump allocation
+// Everything allocated from an arena has to be destroyed before the arena
+class RunArena
+{
+    alignas(std::max_align_t) char buffer[1024];
+    std::pmr::monotonic_buffer_resource resource;
+    std::pmr::memory_resource *previous;
+
+    static thread_local std::pmr::memory_resource *active;
+
+  public:
+    RunArena(std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+    ~RunArena();
+
+    RunArena(const RunArena &) = delete;
+    RunArena &operator=(const RunArena &) = delete;
+
+    // The arena of this thread, or the default resource if there is none
+    static std::pmr::memory_resource *current();
+};
+
+// Measurements of one run of a subprocess and of its parts, see RunSubprocess::stats()
+struct Stats
+{
+    typedef std::chrono::steady_clock clock;
+
+    string name;                       // What ran, e.g. "exec ls", "read var", "|", "&&"
+    int ret = 0;                       // The return code
+    int signal = 0;                    // The signal that killed a child of it, 0 if none did
+    clock::time_point begin{};         // When it was started
+    clock::duration spawn{};           // Time it took to start
+    clock::duration wall{};            // Time from the start until it finished
+    std::chrono::microseconds user{};  // CPU time used by the children
+    std::chrono::microseconds system{};
+    long max_rss = 0;                  // Largest resident set of a child in KiB
+    size_t bytes = 0;                  // Data moved by builtins
+    vector<Stats> children{};          // The parts, mirroring the subprocess tree
+
+    // Add a part, its resources are summed into this one
+    void add(Stats &&child);
+};
+
+// Receives the stats of every run in an Environment, e.g. to emit them as tracing spans
+// It's called from the threads the runs happen on
+class Tracer
+{
+  public:
+    virtual ~Tracer() = default;
+    virtual void trace(const Stats &stats) = 0;
+};
+
 // Represents a subprocess that was started and is possibly still running
 class RunSubprocess
 {
   public:
+    // Allocated from the current RunArena, which is remembered to free it from any thread
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
+    virtual ~RunSubprocess() = default;
+
     // Returns standard streams fds of the running subprocess
     virtual Streams get_streams() const = 0;
     // Waits until the subprocess is finished, returns return code
     virtual int wait() = 0;
+
+    // Calls done with the return code once the subprocess is finished instead of blocking,
+    // the executor watches for it, so an EventLoop needs no thread per subprocess
+    // This object has to stay alive until then and wait() can't be used afterwards
+    virtual void on_exit(Executor &executor, std::function<void(int)> &&done);
+
+    // Sends sig to the children and keeps builtins from starting anything more,
+    // builtins reading or writing pipes end once the children on the other side are gone
+    // Safe to call from any thread while the run is alive
+    virtual void cancel(int sig = SIGTERM);
+
+    // Measurements of this run, complete once it finished
+    // The parts of &&, || and script steps are only recorded if the Environment has a Tracer
+    virtual Stats stats() const;
+
+    // co_await the return code, the coroutine is resumed on a thread of the executor
+    ExitAwaitable async_wait(Executor &executor);
+};
+
+// co_await up to max bytes from fd, e.g. one of RunSubprocess::get_streams(), the fd is made non-blocking
+// From a packet pipe it's a whole packet, up to PIPE_BUF bytes, even if max is smaller
+// The coroutine is resumed on a thread of the executor
+ReadAwaitable async_read(Executor &executor, int fd, size_t max = 64 * 1024);
+
+// How the children of Exec are set up, see Environment::set_launch_options()
+struct LaunchOptions
+{
+    bool process_group = false; // Every child leads a process group of its own, so cancel() reaches its children
+    // Only the standard streams and keep_fds reach the child, all other fds are marked close on exec at once
+    // with close_range(), instead of trusting every fd in the process to have O_CLOEXEC
+    // With keep_fds, PosixSpawn starts the child like VFork, as posix_spawn() can only close a range from 3 up
+    bool close_fds = false;
+    // Fds from 3 up passed to the child with the same numbers, whether or not they have O_CLOEXEC
+    vector<int> keep_fds{};
+
+    // Where and with what the child runs, these are set in the child before exec, where the exec fails
+    // if one can't be applied, PosixSpawn starts such children like VFork
+
+    // The CPUs the child may run on, like taskset, empty keeps those of the parent
+    vector<int> cpus{};
+    // Only the CPUs of this NUMA node, of cpus if they're also given, -1 for any node
+    int numa_node = -1;
+    // setrlimit() of each resource, e.g. {RLIMIT_NOFILE, {1024, 1024}}
+    vector<std::pair<int, rlimit>> rlimits{};
+    // The nice value of the child, like nice -n but not relative, none keeps the parent's
+    std::optional<int> nice{};
+    // The I/O scheduling class and level, like ionice -c -n, class 0 keeps the parent's
+    int io_class = 0;
+    int io_level = 4;
+    // A cgroup v2 directory the child starts in, Fork creates it there with CLONE_INTO_CGROUP,
+    // the other launchers move it there before exec
+    string cgroup{};
+};
+
+// Starts the child process of an Exec, argv and envp are prepared by the caller
+class Launcher
+{
+  public:
+    // fds are the pipe ends prepared for each standard stream, the child keeps
+    // fds[STDIN_FILENO][0], fds[STDOUT_FILENO][1] and fds[STDERR_FILENO][1] and closes the rest
+    // Returns the child pid, if the program could not be executed returns -1 and sets err
+    virtual pid_t launch(
+        char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+    ) const = 0;
+
+    static const Launcher &Fork;       // fork() followed by execvpe()
+    static const Launcher &VFork;      // clone(CLONE_VM | CLONE_VFORK), the parent memory is not copied
+    static const Launcher &PosixSpawn; // posix_spawnp() with file actions, the default
+};
+
+// Starts children from a helper process forked when it's created, which gets argv, envp and
+// the fds over a UNIX socket, so the cost of a launch doesn't depend on the memory or the threads
+// this process has by then, create it early while the process is still small
+// The helper starts them with CLONE_PARENT, so they are children of this process as usual
+// Its buffers are allocated before the fork and it never allocates, so other threads may run meanwhile,
+// it takes argv and envp of up to 2 MiB like the default ARG_MAX
+class Zygote : public Launcher
+{
+    pid_t pid;
+    int sock;
+    mutable std::mutex mutex;
+
+  public:
+    Zygote();
+    ~Zygote();
+
+    Zygote(const Zygote &) = delete;
+    Zygote &operator=(const Zygote &) = delete;
+
+    pid_t launch(
+        char *const argv[], char *const envp[], const int fds[3][2], const LaunchOptions &options, int &err
+    ) const override;
+};
+
+// Runs the builtins (read, echo, &&, ||...) concurrently with their caller
+class Executor
+{
+  public:
+    static const int Readable = 1;
+    static const int Writable = 2;
+
+    virtual ~Executor() = default;
+
+    // Run a task that may block
+    virtual void execute(std::function<void()> &&task) = 0;
+
+    // Call step each time fd is Readable or Writable until it returns true, then close fd
+    // step does as much I/O as it can and returns false once the fd would block
+    // The default runs a poll() loop as a task
+    virtual void watch(int fd, int events, std::function<bool()> &&step);
+
+    static Executor &Threads; // A new thread for every task, the default
+};
+
+// Reuses a number of threads, tasks submitted while none is idle get a thread of their own,
+// queueing them instead could deadlock builtins waiting on each other through a pipe
+class ThreadPool : public Executor
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    vector<std::thread> workers;
+    size_t idle;
+    bool stop;
+
+    void work();
+
+  public:
+    ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    void execute(std::function<void()> &&task) override;
+};
+
+// Drives the I/O of all watched builtins from a single epoll thread,
+// tasks that block (&&, ||) run on a ThreadPool
+class EventLoop : public Executor
+{
+    struct Watch
+    {
+        int fd;
+        std::function<bool()> step;
+    };
+
+    std::optional<ThreadPool> pool;
+    Executor &tasks;
+    int epfd;
+    int wakefd;
+    std::mutex mutex;
+    std::deque<Watch *> ready; // fds epoll can't watch (regular files) are always ready
+    std::deque<Watch *> steps; // The ready ones taken by poll()
+    bool stop;
+    std::thread thread;
+
+    void create();
+    void loop();
+
+  public:
+    EventLoop(size_t threads = std::thread::hardware_concurrency());
+    // Without a thread of its own, the caller drives it with poll(), the tasks run on tasks
+    explicit EventLoop(Executor &tasks);
+    ~EventLoop();
+
+    // Steps the watches that are ready, waits for one if none is, returns false once the loop stops
+    bool poll();
+    // Makes a poll() that's waiting return, from any thread
+    void wake();
+
+    void execute(std::function<void()> &&task) override;
+    void watch(int fd, int events, std::function<bool()> &&step) override;
+};
+
+// Like EventLoop, but waits for the watched fds through one io_uring, so the polls
+// re-armed after a batch of completions go to the kernel in a single call
+// Completions beyond the size of the queue wait in the kernel until they're reaped
+// Throws std::system_error where io_uring isn't available, EventLoop can be used instead
+class Uring : public Executor
+{
+    struct Ring;
+    struct Watch
+    {
+        int fd;
+        unsigned events;
+        std::function<bool()> step;
+    };
+
+    ThreadPool pool;
+    std::unique_ptr<Ring> ring;
+    std::mutex mutex;       // Guards the queues and everything below
+    vector<Watch *> reaped; // Completions reaped by submit() for the loop
+    bool woken;             // A nop was among them
+    bool stop;
+    std::thread thread;
+
+    void queue(Watch *w);
+    void submit();
+    void reap(vector<Watch *> &batch, bool &nop);
+    void loop();
+
+  public:
+    Uring(size_t threads = std::thread::hardware_concurrency(), unsigned entries = 256);
+    ~Uring();
+
+    void execute(std::function<void()> &&task) override;
+    void watch(int fd, int events, std::function<bool()> &&step) override;
+};
+
+// Running subprocesses collected in the order they finish, like `wait -n` in a shell
+// Their exits are watched through on_exit(), on an EventLoop all of them share its thread
+class JobSet
+{
+    struct Finished
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::pair<size_t, int>> jobs;
+    };
+
+    Executor &executor;
+    std::shared_ptr<Finished> finished;
+    std::unordered_map<size_t, runsubprocess> jobs;
+    size_t next;
+
+    std::pair<size_t, int> collect(std::unique_lock<std::mutex> &lock);
+
+  public:
+    JobSet(Executor &executor = Executor::Threads);
+    // Waits for the jobs still running
+    ~JobSet();
+
+    JobSet(const JobSet &) = delete;
+    JobSet &operator=(const JobSet &) = delete;
+
+    // Takes over a started subprocess, e.g. from spawn(), returns its id
+    size_t add(runsubprocess &&job);
+    // The number of jobs not collected yet
+    size_t size() const;
+
+    // Waits for the next job to finish, returns its id and return code
+    std::pair<size_t, int> wait_any();
+    // Returns a job that already finished, if there is one
+    std::optional<std::pair<size_t, int>> try_wait_any();
+    // Waits for all the jobs, returns the first nonzero return code in the order they finished
+    int wait_all();
 };
 
 // Represents the subprocess environment
 class Environment
 {
     friend class Read;
+    friend class Sink;
+    friend class Filter;
+    friend class Fanout;
+    friend class Cached;
+    friend class Profiled;
+    friend class And;
+    friend class Or;
+    friend class Subprocess;
     friend class Exec;
+    friend class Echo;
+    friend class Pipe;
+    friend class RunThread;
     friend GettableVariable;
+    friend int run(const subprocess &, Environment &);
+    friend int run(const subprocess &, const Environment &);
+    friend int run(const subprocess &, Environment &, Cancellation &);
+    friend int run(const subprocess &, const Environment &, Cancellation &);
+    friend int run(const script &, Environment &, const ParallelOptions &);
+    friend int run(const script &, const Environment &, const ParallelOptions &);
+    friend vector<BatchResult> run_batch(const subprocess &, const vector<string> &, size_t, const Environment &);
+
+    // A value and whether it's exported to children
+    typedef std::pair<string, bool> Var;
+
+    // Variables live in layers, a layer that's shared between copies is never changed,
+    // a change to it goes to a new layer on top, so copying an Environment is O(1)
+    struct Vars
+    {
+        struct Hash
+        {
+            typedef void is_transparent;
+            size_t operator()(std::string_view name) const;
+        };
+
+        std::unordered_map<string, Var, Hash, std::equal_to<>> own;
+        std::shared_ptr<const Vars> parent;
+        size_t depth = 0;
+
+        // Looks name up in this layer and the ones below it, nullptr if it's not set
+        const Var *find(std::string_view name) const;
+    };
+
+    // Layers deeper than this are flattened into one
+    static const size_t max_depth = 8;
+
+    std::shared_ptr<Vars> vars;
+    const Launcher *launcher;
+    Executor *executor;
+    PipeOptions pipe_options;
+    LaunchOptions launch_options;
+    Tracer *tracer;
+
+    // Incremented on every change of env
+    std::atomic<uint64_t> generation;
+
+    // The exported variables in the NAME=value form passed to exec
+    struct Envp
+    {
+        vector<string> vars;
+        vector<char *> ptrs;
+    };
 
-    std::map<string, std::pair<string, bool>> env;
+    // Guards vars and the envp cache
+    // envp() is rebuilt only when generation differs from envp_generation
+    mutable std::mutex mutex;
+    mutable std::shared_ptr<const Envp> envp_cache;
+    mutable uint64_t envp_generation;
 
     Environment(char **list);
 
-    vector<const char *> envp() const;
+    std::shared_ptr<const Envp> envp() const;
+
+    // options with numa_node resolved into cpus, throws std::invalid_argument for values no child can get
+    static LaunchOptions checked(const LaunchOptions &options);
+
+    // A snapshot of the variables that no change will touch
+    std::shared_ptr<const Vars> snapshot() const;
+    // Sets name to value, an exported variable stays exported
+    void set(const string &name, string &&value);
+
+    template <typename E>
+    static int run_parallel(const script &, E &env, const ParallelOptions &);
 
   public:
     Environment(const Environment &env = global);
+    Environment &operator=(const Environment &env);
 
     // The environment of this process (**environ)
     static const Environment global;
 
+    // Choose how Exec starts child processes in this environment
+    void set_launcher(const Launcher &);
+    // Choose where builtins run in this environment, the executor has to outlive their runs
+    void set_executor(Executor &);
+    // Settings for every pipe created in this environment, unless a Pipe has its own
+    void set_pipe_options(const PipeOptions &);
+    // How the children are set up in this environment
+    void set_launch_options(const LaunchOptions &);
+    // Report the stats of every run in this environment, the tracer has to outlive them
+    void set_tracer(Tracer &);
+
     // Run a subprocess in this environment
     int run(const subprocess &);
     int run(const subprocess &) const;
@@ -82,36 +553,129 @@ class Environment
     // Run a script in this environment
     int run(const script &);
     int run(const script &) const;
+    int run(const script &, const ParallelOptions &);
+    int run(const script &, const ParallelOptions &) const;
+};
+
+// Cancels the runs given it, see run(const subprocess &, Environment &, Cancellation &), when cancel()
+// is called or once its deadline passes; any number of runs can share it, also on other threads
+class Cancellation
+{
+    friend int run(const subprocess &, Environment &, Cancellation &);
+    friend int run(const subprocess &, const Environment &, Cancellation &);
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    vector<RunSubprocess *> runs;
+    int signal; // What it was cancelled with, 0 until then
+    bool stop;
+    std::thread timer;
+
+    void add(RunSubprocess *running);
+    void remove(RunSubprocess *running);
+
+  public:
+    Cancellation();
+    // Cancels with sig once timeout has passed, from a thread of its own
+    Cancellation(Stats::clock::duration timeout, int sig = SIGKILL);
+    ~Cancellation();
+
+    Cancellation(const Cancellation &) = delete;
+    Cancellation &operator=(const Cancellation &) = delete;
+
+    // Cancels the runs going on and every later one, see RunSubprocess::cancel()
+    void cancel(int sig = SIGTERM);
+    bool cancelled() const;
 };
 
+// Strings and variables joined at a subprocess runtime, e.g. "prefix-" + ${"x"}
+struct Interpolation
+{
+    vector<gettable> parts;
+};
+
+template <typename T>
+subprocess grep(const T &text, bool invert = false);
+template <typename T>
+subprocess tee(const T &path, bool append = false);
+
 // Represents an argument that gets evaluated at a subprocess runtime
-class Gettable
+class Gettable : public std::enable_shared_from_this<Gettable>
 {
+    template <typename T>
+    friend subprocess grep(const T &text, bool invert);
+    template <typename T>
+    friend subprocess tee(const T &path, bool append);
     template <typename T>
     friend subprocess open(const T &path, int mode);
+    template <typename T>
+    friend subprocess memory(const T &data);
     template <typename S, typename... T>
     friend subprocess make_subprocess(const T &...args);
+    friend Interpolation operator+(const string &, const GettableVariable &);
+    friend Interpolation operator+(const GettableVariable &, const string &);
+    friend Interpolation operator+(const GettableVariable &, const GettableVariable &);
+    friend Interpolation operator+(Interpolation, const string &);
+    friend Interpolation operator+(Interpolation, const GettableVariable &);
 
-    // The argument can be either a plain string or an environment variable
+    // The argument can be a plain string, an environment variable or their interpolation
     static gettable make_gettable(const string &value);
     static gettable make_gettable(const GettableVariable &var);
+    static gettable make_gettable(const Interpolation &interpolation);
 
   public:
+    virtual ~Gettable() = default;
+
     // This funcion evaluates the argument and returns a string
     virtual string get(const Environment &env) const = 0;
+    // Evaluates the argument without copying it, as views of pieces to be joined,
+    // which stay valid while hold is alive, the variables can change in the meantime
+    // The default holds the result of get()
+    virtual void pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const;
+    // True if get() returns the same string in every Environment
+    virtual bool is_constant() const;
+    // Adds the names of the variables get() reads
+    virtual void get_variables(vector<string> &) const;
 };
 
 class Subprocess
 {
   public:
+    virtual ~Subprocess() = default;
+
     virtual runsubprocess start(Streams, const Environment & = Environment::global) const = 0;
     virtual runsubprocess start(Streams, Environment &) const;
 
+    // Returns a new node sharing the children of this one
     virtual subprocess copy() const = 0;
 
     virtual StreamFlags get_flags() const;
+    // Adds the variables this subprocess and its children use
+    virtual void get_variables(Variables &) const;
     runsubprocess start() const;
 
+    // True if get_output() can tell the output without running anything, given the whole input if input,
+    // e.g. for echo; builtins piped together then hand it over without a kernel pipe
+    virtual bool has_output(bool input) const;
+    // The whole output, see has_output(), in is the whole input or null
+    virtual string get_output(const Environment &env, const string *in) const;
+    // The same without input as views, hold keeps them alive, e.g. the arguments of echo where they are
+    virtual void output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const;
+    // True if start_with() can take the whole input in memory instead of a stdin
+    virtual bool takes_input() const;
+    // Starts with in as the whole input instead of a stdin, see takes_input()
+    virtual runsubprocess start_with(string &&in, Streams, const Environment &) const;
+    virtual runsubprocess start_with(string &&in, Streams, Environment &) const;
+
+    // Runs to the end without streams, like start({}, env)->wait(), stats gets what ran if env is traced
+    // run() uses it, so && and || are evaluated on the calling thread rather than on a RunThread
+    virtual int execute(const Environment &env, Stats &stats) const;
+    virtual int execute(Environment &env, Stats &stats) const;
+
+    // Starts n copies with the same streams, the fds given in str are passed to every copy
+    // The setup they share, e.g. the arguments and envp of an Exec, is done once for all of them
+    virtual vector<runsubprocess> start_many(size_t n, Streams, const Environment & = Environment::global) const;
+
     // Check if the Streams are compatible with the process StreamFlags
     void check_streams(Streams) const;
     static bool check_stream(int, int);
@@ -135,9 +699,13 @@ class Read : public Subprocess
 
   public:
     StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
     runsubprocess start(Streams, Environment &) const override;
+    bool takes_input() const override;
+    runsubprocess start_with(string &&in, Streams, const Environment &) const override;
+    runsubprocess start_with(string &&in, Streams, Environment &) const override;
 };
 
 struct GettableVariable : public Gettable
@@ -147,6 +715,8 @@ struct GettableVariable : public Gettable
     const string name;
 
     string get(const Environment &env) const;
+    void pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    void get_variables(vector<string> &) const override;
 };
 
 class GettableString : public Gettable
@@ -159,20 +729,55 @@ class GettableString : public Gettable
 
   public:
     string get(const Environment &env) const;
+    void pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    bool is_constant() const override;
+};
+
+class GettableConcat : public Gettable
+{
+    friend class Gettable;
+
+    const vector<gettable> parts;
+
+    GettableConcat(const vector<gettable> &parts);
+
+  public:
+    // Joined straight into the result, its size is known up front
+    string get(const Environment &env) const;
+    void pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    bool is_constant() const override;
+    void get_variables(vector<string> &) const override;
 };
 
+// Join strings and variables
+Interpolation operator+(const string &lhs, const GettableVariable &rhs);
+Interpolation operator+(const GettableVariable &lhs, const string &rhs);
+Interpolation operator+(const GettableVariable &lhs, const GettableVariable &rhs);
+Interpolation operator+(Interpolation lhs, const string &rhs);
+Interpolation operator+(Interpolation lhs, const GettableVariable &rhs);
+
 class RunPipe : public RunSubprocess
 {
     friend class Pipe;
+    friend class ErrPipe;
+    friend class Cached;
+    friend class Fanout;
 
     runsubprocess lhs;
     runsubprocess rhs;
+    Streams streams;
+    const char *name;
 
+    // The streams are stdin of lhs and the output of rhs unless others are given
     RunPipe(runsubprocess &&lhs, runsubprocess &&rhs);
+    RunPipe(runsubprocess &&lhs, runsubprocess &&rhs, Streams streams, const char *name);
 
   public:
     Streams get_streams() const override;
     int wait() override;
+    void on_exit(Executor &executor, std::function<void(int)> &&done) override;
+    void cancel(int sig) override;
+    Stats stats() const override;
 };
 
 class Pipe : public Subprocess
@@ -186,8 +791,20 @@ class Pipe : public Subprocess
     friend subprocess operator<(const subprocess &lhs, const T &rhs);
     template <typename T>
     friend subprocess operator<<(const subprocess &lhs, const T &rhs);
+    friend subprocess pipe(const subprocess &lhs, const subprocess &rhs, const PipeOptions &options);
+    friend class Cached;
 
-    Pipe(const subprocess &lhs, const subprocess &rhs);
+    Pipe(const subprocess &lhs, const subprocess &rhs, const std::optional<PipeOptions> &options = {});
+
+    // Settings of this pipe, the environment ones if none are given
+    const std::optional<PipeOptions> options;
+
+    // Moves everything from one fd to the other in the kernel, closes both when done
+    static runsubprocess transfer(const Environment &env, int in, int out);
+    // Writes data to out, a fd or Streams::New, from the executor like echo
+    static runsubprocess write(const Environment &env, string &&data, int out);
+    // The same from views, hold keeps them alive until then
+    static runsubprocess write(const Environment &env, vector<std::string_view> &&segs, holder &&hold, int out);
 
     template <typename E>
     runsubprocess start(Streams str, E env) const
@@ -199,17 +816,72 @@ class Pipe : public Subprocess
 
         runsubprocess lhs_p;
         runsubprocess rhs_p;
+        const PipeOptions &opts = options ? *options : env.pipe_options;
 
-        if ((lhs_f.out & StreamFlags::Create) && (rhs_f.in & StreamFlags::Accept))
+        // A known output goes to the other side in memory, or through a single writer if it can't take it,
+        // unless pipe settings, given or of the environment, ask for a kernel pipe
+        if (!options && !opts.capacity && !opts.packet && lhs->has_output(false))
+        {
+            if (rhs->takes_input())
+                return rhs->start_with(
+                    lhs->get_output(env, nullptr), {.in = Streams::None, .out = str.out, .err = str.err}, env
+                );
+            vector<std::string_view> segs{};
+            holder hold{};
+            lhs->output_pieces(env, segs, hold);
+            if (rhs_f.in & StreamFlags::Accept)
+            {
+                lhs_p = write(env, std::move(segs), std::move(hold), Streams::New);
+                rhs_p = rhs->start({.in = lhs_p->get_streams().out, .out = str.out, .err = str.err}, env);
+            }
+            else
+            {
+                // e.g. a file, which is then written directly
+                rhs_p = rhs->start({.in = Streams::New, .out = str.out, .err = str.err}, env);
+                lhs_p = write(env, std::move(segs), std::move(hold), rhs_p->get_streams().in);
+            }
+            return runsubprocess(new RunPipe(std::move(lhs_p), std::move(rhs_p)));
+        }
+
+        if (options && (lhs_f.out & StreamFlags::Accept) && (rhs_f.in & StreamFlags::Accept))
+        {
+            // Both sides accept a fd, so the pipe is created here with its own settings
+            int fds[2];
+            create(fds, opts);
+            try
+            {
+                lhs_p = lhs->start({.in = str.in, .out = fds[1]}, env);
+            }
+            catch (...)
+            {
+                // The write end went to lhs, the read end wasn't given to anyone yet
+                close(fds[0]);
+                throw;
+            }
+            rhs_p = rhs->start({.in = fds[0], .out = str.out, .err = str.err}, env);
+        }
+        else if ((lhs_f.out & StreamFlags::Create) && (rhs_f.in & StreamFlags::Accept))
         {
             lhs_p = lhs->start({.in = str.in, .out = Streams::New}, env);
-            rhs_p = rhs->start({.in = lhs_p->get_streams().out, .out = str.out}, env);
+            if (options)
+                resize(lhs_p->get_streams().out, opts);
+            rhs_p = rhs->start({.in = lhs_p->get_streams().out, .out = str.out, .err = str.err}, env);
         }
         else if ((lhs_f.out & StreamFlags::Accept) && (rhs_f.in & StreamFlags::Create))
         {
-            rhs_p = rhs->start({.in = Streams::New, .out = str.out}, env);
+            rhs_p = rhs->start({.in = Streams::New, .out = str.out, .err = str.err}, env);
+            if (options)
+                resize(rhs_p->get_streams().in, opts);
             lhs_p = lhs->start({.in = str.in, .out = rhs_p->get_streams().in}, env);
         }
+        else if ((lhs_f.out & StreamFlags::Create) && (rhs_f.in & StreamFlags::Create))
+        {
+            // Neither side accepts a fd (e.g. a file to file redirection), so the data is moved between them
+            lhs_p = lhs->start({.in = str.in, .out = Streams::New}, env);
+            rhs_p = rhs->start({.in = Streams::New, .out = str.out, .err = str.err}, env);
+            runsubprocess mid = transfer(env, lhs_p->get_streams().out, rhs_p->get_streams().in);
+            rhs_p = runsubprocess(new RunPipe(std::move(mid), std::move(rhs_p)));
+        }
         else
         {
             throw std::invalid_argument("Invalid pipe connection attempt");
@@ -222,7 +894,15 @@ class Pipe : public Subprocess
     const subprocess lhs;
     const subprocess rhs;
 
+    // Create a kernel pipe with the options applied
+    static void create(int fds[2], const PipeOptions &options);
+    // Apply the capacity to an existing pipe
+    static void resize(int fd, const PipeOptions &options);
+
     StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    bool has_output(bool input) const override;
+    string get_output(const Environment &env, const string *in) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
     runsubprocess start(Streams, Environment &) const override;
@@ -231,26 +911,76 @@ class Pipe : public Subprocess
 class Or : public Subprocess
 {
     friend subprocess operator||(const subprocess &lhs, const subprocess &rhs);
-    subprocess lhs;
-    subprocess rhs;
+    const subprocess lhs;
+    const subprocess rhs;
 
     Or(const subprocess &lhs, const subprocess &rhs);
 
+    template <typename E>
+    int evaluate(E env, Stats &stats) const;
+
   public:
+    void get_variables(Variables &) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
     runsubprocess start(Streams, Environment &) const override;
+    int execute(const Environment &env, Stats &stats) const override;
+    int execute(Environment &env, Stats &stats) const override;
 };
 
 class And : public Subprocess
 {
     friend subprocess operator&&(const subprocess &lhs, const subprocess &rhs);
-    subprocess lhs;
-    subprocess rhs;
+    const subprocess lhs;
+    const subprocess rhs;
 
     And(const subprocess &lhs, const subprocess &rhs);
 
+    template <typename E>
+    int evaluate(E env, Stats &stats) const;
+
   public:
+    void get_variables(Variables &) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+    runsubprocess start(Streams, Environment &) const override;
+    int execute(const Environment &env, Stats &stats) const override;
+    int execute(Environment &env, Stats &stats) const override;
+};
+
+// Stderr of lhs is the stdin of rhs, the other streams are those of lhs, see pipe_err()
+class ErrPipe : public Subprocess
+{
+    friend subprocess pipe_err(const subprocess &lhs, const subprocess &rhs);
+
+    ErrPipe(const subprocess &lhs, const subprocess &rhs);
+
+    template <typename E>
+    runsubprocess start(Streams str, E env) const;
+
+  public:
+    const subprocess lhs;
+    const subprocess rhs;
+
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+    runsubprocess start(Streams, Environment &) const override;
+};
+
+// Stderr goes wherever stdout goes, see merge_err()
+class MergeErr : public Subprocess
+{
+    friend subprocess merge_err(const subprocess &sub);
+
+    const subprocess sub;
+
+    MergeErr(const subprocess &sub);
+
+  public:
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
     runsubprocess start(Streams, Environment &) const override;
@@ -270,22 +1000,53 @@ class Exec : public Subprocess
     vector<gettable> argv;
     Exec(const vector<gettable> &a);
 
+    // If every argument is constant, argv is evaluated once here and reused by start()
+    vector<string> const_args;
+    vector<char *> const_argv;
+
+    // The arguments evaluated in env into args, unless they're constant
+    char *const *get_argv(const Environment &env, std::pmr::vector<string> &args, std::pmr::vector<char *> &c_argv)
+        const;
+    // Starts the child once everything is prepared, the child ends of fds are closed afterwards,
+    // all of them if it fails
+    runsubprocess launch(
+        char *const argv[], char *const envp[], Streams str, int fds[3][2], bool merged, const Environment &env,
+        Stats::clock::time_point begin
+    ) const;
+
   public:
+    // const_argv points into const_args, copy() rebuilds both from argv instead
+    Exec(const Exec &) = delete;
+    Exec &operator=(const Exec &) = delete;
+
     StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
+    vector<runsubprocess> start_many(size_t n, Streams, const Environment &) const override;
 };
 
 class RunExec : public RunSubprocess
 {
     friend Exec;
     pid_t pid;
+    bool group; // The child leads its own process group
+    std::mutex mutex;
+    bool reaped; // Set before the child is reaped, signals are only sent before, so never to a reused pid
     Streams streams;
-    RunExec(pid_t pid, Streams streams);
+    Stats record;
+    RunExec(pid_t pid, bool group, Streams streams, Stats &&record);
+
+    // Record how the child exited, signal is the one that killed it or 0, returns the return code
+    int finish(int ret, int signal, const ::rusage &usage);
 
   public:
+
     Streams get_streams() const override;
     int wait() override;
+    void on_exit(Executor &executor, std::function<void(int)> &&done) override;
+    void cancel(int sig) override;
+    Stats stats() const override;
 };
 
 class Echo : public Subprocess
@@ -293,31 +1054,257 @@ class Echo : public Subprocess
     template <typename S, typename... T>
     friend subprocess make_subprocess(const T &...args);
 
+    friend class Memory;
+    friend class Filter;
+
     vector<gettable> var;
     Echo(const vector<gettable> &a);
 
+    // The views of the arguments separated by spaces and followed by a newline
+    static void segments(const vector<gettable> &args, const Environment &env, vector<std::string_view> &out,
+                         holder &hold);
+    // Writes the segments from the executor, hold keeps them alive until then
+    static runsubprocess write(Streams str, const Environment &env, vector<std::string_view> &&segments,
+                               holder &&hold);
+
+  public:
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    bool has_output(bool input) const override;
+    string get_output(const Environment &env, const string *in) const override;
+    void output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+};
+
+// Hands the output to a callback as it arrives, see sink() and lines()
+class Sink : public Subprocess
+{
+  public:
+    // Gets the next piece of output, returns false to stop reading, which closes the pipe
+    typedef std::function<bool(std::string_view)> Callback;
+
+  private:
+    friend subprocess sink(const Callback &callback, size_t buffer);
+    friend subprocess lines(const Callback &callback, size_t buffer);
+
+    const Callback callback;
+    const size_t buffer;
+    const bool split;
+
+    Sink(const Callback &callback, size_t buffer, bool split);
+
+  public:
+    StreamFlags get_flags() const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+};
+
+// A stage run in-process from stdin to stdout, see head(), tail(), grep(), cut(), wc() and tee()
+class Filter : public Subprocess
+{
+  public:
+    // Gets the input piece by piece, then an empty piece at its end, and appends its output to out
+    // Returns false once it needs no more input, the pipe is then closed like head does
+    // Throws std::system_error on an I/O error of its own, the filter then stops and returns its code
+    typedef std::function<bool(std::string_view in, string &out)> Step;
+    // Makes the step of a run from the arguments evaluated in its environment
+    typedef std::function<Step(const vector<string> &args)> Factory;
+
+    // What wc() counts, a combination is printed in this order
+    static const int Lines = 1;
+    static const int Words = 2;
+    static const int Bytes = 4;
+
+  private:
+    friend subprocess head(size_t count);
+    friend subprocess tail(size_t count);
+    friend subprocess cut(char delimiter, size_t field);
+    friend subprocess wc(int count);
+    template <typename T>
+    friend subprocess grep(const T &text, bool invert);
+    template <typename T>
+    friend subprocess tee(const T &path, bool append);
+
+    const string name;
+    const vector<gettable> args;
+    const Factory factory;
+    const bool pure; // The steps only make the output, unlike those of tee, so they can run in memory
+
+    Filter(const string &name, const vector<gettable> &args, const Factory &factory, bool pure = true);
+
+    static Factory grep_factory(bool invert);
+    static Factory tee_factory(bool append);
+
   public:
     StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    bool has_output(bool input) const override;
+    string get_output(const Environment &env, const string *in) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
+    bool takes_input() const override;
+    runsubprocess start_with(string &&in, Streams, const Environment &) const override;
+};
+
+// Copies stdin to the stdin of every output and to stdout in the kernel, see fanout()
+class Fanout : public Subprocess
+{
+    friend subprocess fanout(const vector<subprocess> &outputs);
+
+    const vector<subprocess> outputs;
+
+    Fanout(const vector<subprocess> &outputs);
+
+    template <typename E>
+    runsubprocess start(Streams str, E env) const;
+
+  public:
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+    runsubprocess start(Streams, Environment &) const override;
+};
+
+// Replays the stdout, variables and return code of an earlier run while they're fresh, see cached()
+class Cached : public Subprocess
+{
+    friend subprocess cached(const subprocess &sub, Stats::clock::duration ttl, const vector<string> &files);
+
+    struct Entry
+    {
+        string output;
+        vector<std::pair<string, string>> vars; // The values sub set
+        int ret;
+        Stats::clock::time_point expires;
+    };
+
+    // Shared by the copies of the tree, every run in any environment looks it up
+    struct Cache
+    {
+        std::mutex mutex;
+        std::unordered_map<string, Entry> entries;
+    };
+
+    const subprocess sub;
+    const Stats::clock::duration ttl;
+    const vector<string> files;
+    const std::shared_ptr<Cache> cache;
+    // The variables of sub, sorted
+    vector<string> reads;
+    vector<string> writes;
+    bool exports;
+
+    Cached(const subprocess &sub, Stats::clock::duration ttl, const vector<string> &files,
+           const std::shared_ptr<Cache> &cache);
+
+    // What the run depends on in env: the variables sub reads, the exported ones if it starts children,
+    // and the modification time of files
+    string key(const Environment &env) const;
+
+    template <typename E>
+    runsubprocess start(Streams str, E env) const;
+
+  public:
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+    runsubprocess start(Streams, Environment &) const override;
+};
+
+// Starts the children of a subtree with launch options of its own, see profile()
+class Profiled : public Subprocess
+{
+    friend subprocess profile(const subprocess &sub, const LaunchOptions &options);
+
+    const subprocess sub;
+    const LaunchOptions options;
+
+    Profiled(const subprocess &sub, const LaunchOptions &options);
+
+  public:
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    bool has_output(bool input) const override;
+    string get_output(const Environment &env, const string *in) const override;
+    void output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+    runsubprocess start(Streams, Environment &) const override;
+};
+
+// A run that turns the return code of another one into its own once it's finished
+class RunFinish : public RunSubprocess
+{
+    friend class Cached;
+    friend class Profiled;
+
+    // Also keeps what inner uses alive, so it's destroyed after it
+    std::function<int(int)> finish;
+    runsubprocess inner;
+    std::atomic<int> cancelled; // The signal cancel() was called with
+
+    RunFinish(runsubprocess &&inner, std::function<int(int)> &&finish);
+
+  public:
+    Streams get_streams() const override;
+    int wait() override;
+    void on_exit(Executor &executor, std::function<void(int)> &&done) override;
+    void cancel(int sig) override;
+    Stats stats() const override;
 };
 
 class RunThread : public RunSubprocess
 {
     friend Read;
+    friend Sink;
+    friend Filter;
+    friend Fanout;
+    friend Cached;
     friend Echo;
     friend And;
     friend Or;
-
-    int ret;
-    std::thread thread;
+    friend Pipe;
+
+    Stats record;
+    bool done;
+    int cancelled;         // The signal cancel() was called with
+    RunSubprocess *part;   // The running part of the builtin, see run_part()
+    std::mutex mutex;
+    std::condition_variable cv;
     Streams streams;
 
-    RunThread(std::function<void(int &)> &&fun, Streams str);
+    // Run a blocking function as a task of the environment executor, it sets the return code
+    // and the bytes it moved in the Stats
+    RunThread(
+        const Environment &env, const string &name, std::function<void(RunThread &, Stats &)> &&fun, Streams str
+    );
+    // Run a non-blocking step on fd, see Executor::watch
+    RunThread(
+        const Environment &env, const string &name, int fd, int events, std::function<bool(Stats &)> &&step,
+        Streams str
+    );
+
+    // Called by finish() instead of waking wait()
+    std::function<void(int)> exit_callback;
+
+    void finish();
+
+    // Run a part of a builtin like run(), its stats are added to parent if the environment is traced
+    // Returns ECANCELED without starting it once this is cancelled
+    template <typename E>
+    int run_part(const subprocess &sub, E &env, Stats &parent);
 
   public:
+    ~RunThread();
+
     Streams get_streams() const override;
     int wait() override;
+    void on_exit(Executor &executor, std::function<void(int)> &&done) override;
+    void cancel(int sig) override;
+    Stats stats() const override;
 };
 
 class File : public Subprocess
@@ -336,6 +1323,7 @@ class File : public Subprocess
     static const int Append = 4;
 
     StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
     subprocess copy() const override;
     runsubprocess start(Streams, const Environment &) const override;
 };
@@ -354,24 +1342,93 @@ class False : public Subprocess
     runsubprocess start(Streams, const Environment &) const override;
 };
 
+// Output of a string from memory, like echo but through a memfd instead of a pipe,
+// so no thread is needed to write it and readers see a regular file
+class Memory : public Subprocess
+{
+    template <typename T>
+    friend subprocess memory(const T &data);
+    friend class Pipe;
+
+    gettable data;
+
+    Memory(const gettable &data);
+
+    // Writes the segments to a new memfd, or like echo does, hold keeps them alive until then
+    static runsubprocess write(Streams str, const Environment &env, vector<std::string_view> &&segs,
+                               holder &&hold, const string &name);
+
+  public:
+    // Larger data is written through a pipe by a builtin, like echo does
+    static const size_t max_size = 64 * 1024;
+
+    StreamFlags get_flags() const override;
+    void get_variables(Variables &) const override;
+    bool has_output(bool input) const override;
+    string get_output(const Environment &env, const string *in) const override;
+    void output_pieces(const Environment &env, vector<std::string_view> &out, holder &hold) const override;
+    subprocess copy() const override;
+    runsubprocess start(Streams, const Environment &) const override;
+};
+
 class RunEmpty : public RunSubprocess
 {
+    friend class Read;
+    friend class Filter;
+    friend class Cached;
     friend class File;
+    friend class Memory;
     friend class True;
     friend class False;
+    friend class Exec;
 
     Streams streams;
-    int ret;
-    RunEmpty(Streams str, int ret);
+    Stats record;
+    RunEmpty(Streams str, int ret, const string &name);
 
   public:
     Streams get_streams() const override;
     int wait() override;
+    void on_exit(Executor &executor, std::function<void(int)> &&done) override;
+    Stats stats() const override;
 };
 
 // Read stdout of pipe into a environment variable ename, requires a non-const Environment
 subprocess read(const string &name);
 
+// Call callback with the output in chunks of at most buffer bytes as they arrive,
+// only buffer bytes are held and a slow callback makes the writer block on the pipe
+subprocess sink(const Sink::Callback &callback, size_t buffer = 64 * 1024);
+// Call callback with every line of the output without the newline,
+// a line longer than buffer is passed in pieces of buffer bytes
+subprocess lines(const Sink::Callback &callback, size_t buffer = 64 * 1024);
+
+// In-process filters, they save the fork and exec of the command they're named after
+
+// The first count lines, like head -n
+subprocess head(size_t count = 10);
+// The last count lines, like tail -n
+subprocess tail(size_t count = 10);
+// The field-th field, from 1, of every line split on delimiter, like cut -d -f,
+// lines without the delimiter are passed whole
+subprocess cut(char delimiter, size_t field);
+// The number of Filter::Lines, Words or Bytes of the input, like wc without the padding
+subprocess wc(int count = Filter::Lines);
+
+// The lines containing a string or variable, or the others if invert, like grep -F
+template <typename T>
+subprocess grep(const T &text, bool invert)
+{
+    return subprocess(new Filter("grep", {Gettable::make_gettable(text)}, Filter::grep_factory(invert)));
+}
+
+// Copies the input to a file as it passes, like tee
+template <typename T>
+subprocess tee(const T &path, bool append)
+{
+    return subprocess(new Filter("tee", {Gettable::make_gettable(path)}, Filter::tee_factory(append), false));
+}
+
 // Open a file, use macros from File:: to specifie open mode
 template <typename T>
 subprocess open(const T &f, int mode)
@@ -379,6 +1436,13 @@ subprocess open(const T &f, int mode)
     return subprocess(new File(Gettable::make_gettable(f), mode));
 }
 
+// Output a string or variable followed by a newline, like echo, from a memfd
+template <typename T>
+subprocess memory(const T &data)
+{
+    return subprocess(new Memory(Gettable::make_gettable(data)));
+}
+
 // Echo a string or variable
 #define echo make_subprocess<Echo>
 
@@ -392,6 +1456,8 @@ const static subprocess true_ = subprocess(new True());
 
 // Construct a pipe
 subprocess operator|(const subprocess &lhs, const subprocess &rhs);
+// Construct a pipe with its own kernel pipe settings
+subprocess pipe(const subprocess &lhs, const subprocess &rhs, const PipeOptions &options);
 // Construct an ... or ...
 subprocess operator||(const subprocess &lhs, const subprocess &rhs);
 // Construct an ... and ...
@@ -411,6 +1477,33 @@ subprocess operator>(const subprocess &lhs, const T &rhs)
     return subprocess(new Pipe(lhs, open(rhs, File::Write)));
 }
 
+// Pipe stderr of lhs into rhs, while the stdout of lhs stays the output, like lhs 2> >(rhs)
+subprocess pipe_err(const subprocess &lhs, const subprocess &rhs);
+// Send stderr wherever stdout goes, like 2>&1, in a pipeline it applies to the last stage
+subprocess merge_err(const subprocess &sub);
+// Copy stdin to every output as well as to stdout, like tee >(a) >(b), the outputs write to the
+// inherited stdout, the data is shared between the pipes with tee(2) instead of being copied for each
+subprocess fanout(const vector<subprocess> &outputs);
+
+// Run sub once and replay its stdout and return code for ttl, without starting it again, as long as
+// the variables it reads, the exported ones if it starts children, and the modification times of files
+// are the same; it reads no stdin, its stderr isn't replayed
+// Used as cached(x) | read("var"), the read runs each time on the replayed output; cached(x | read("var"))
+// replays the variables sub sets as well, which needs a non-const Environment
+subprocess cached(const subprocess &sub, Stats::clock::duration ttl, const vector<string> &files = {});
+
+// Start the children of sub with options instead of those of the environment, e.g. to pin
+// one stage of a pipeline or a whole one, sub runs in a copy of the environment and
+// the variables it sets are set in the environment once it's finished
+subprocess profile(const subprocess &sub, const LaunchOptions &options);
+
+// Redirect stderr to a file, like 2> or 2>> with append
+template <typename T>
+subprocess err_to(const subprocess &lhs, const T &path, bool append = false)
+{
+    return pipe_err(lhs, open(path, File::Write | (append ? File::Append : 0)));
+}
+
 // Read stdin from a file
 template <typename T>
 subprocess operator<(const subprocess &lhs, const T &rhs)
@@ -422,7 +1515,7 @@ subprocess operator<(const subprocess &lhs, const T &rhs)
 template <typename T>
 subprocess operator<<(const subprocess &lhs, const T &rhs)
 {
-    return subprocess(new Pipe(echo(rhs), lhs));
+    return subprocess(new Pipe(memory(rhs), lhs));
 }
 
 int run(const subprocess &subprocess, Environment &env);
@@ -431,6 +1524,228 @@ int run(const vector<subprocess> &script, Environment &env);
 int run(const subprocess &subprocess, const Environment &env = Environment::global);
 int run(const vector<subprocess> &script, const Environment &env = Environment::global);
 
+// Run until finished or cancelled, a script starts no more steps once it's cancelled
+int run(const subprocess &subprocess, Environment &env, Cancellation &cancellation);
+int run(const subprocess &subprocess, const Environment &env, Cancellation &cancellation);
+int run(const script &script, Environment &env, Cancellation &cancellation);
+int run(const script &script, const Environment &env, Cancellation &cancellation);
+
+// Start a subprocess in the background, like `cmd &` in a shell, see JobSet
+runsubprocess spawn(const subprocess &subprocess, Environment &env);
+runsubprocess spawn(const subprocess &subprocess, const Environment &env = Environment::global);
+
+// What one input of run_batch() gave
+struct BatchResult
+{
+    int ret = 0; // The return code
+    string out;  // Everything written to stdout
+};
+
+// Runs subprocess once for each of inputs, which it gets as its stdin, with up to parallelism copies
+// running at once, 0 is one per CPU, returns their results in the order of inputs
+// The copies are started with start_many(), their pipes and exits are all driven from one epoll set
+// on the calling thread, only builtins without a pidfd to watch still need the executor of env
+vector<BatchResult> run_batch(
+    const subprocess &subprocess, const vector<string> &inputs, size_t parallelism = 0,
+    const Environment &env = Environment::global
+);
+
+// A subprocess kept running to answer requests, like coproc in a shell, so a request costs a pipe
+// write instead of a fork and exec; each request is written to its stdin followed by the delimiter,
+// the response is what it writes to stdout up to the next delimiter, e.g. jq -c --unbuffered
+// It's started again once it exits, a request it exits during throws std::system_error
+// Not thread-safe, see CoprocessPool
+class Coprocess
+{
+    subprocess sub;
+    Environment env;
+    char delimiter;
+    runsubprocess running;
+    int in;
+    int out;
+    bool broken;   // The last request failed, so its state is unknown
+    string buffer; // What was read past the last response
+
+    void start();
+    void stop(int sig);
+
+  public:
+    Coprocess(const subprocess &sub, char delimiter = '\n', const Environment &env = Environment::global);
+    // Closes its stdin and stdout and waits for it to exit, output not read yet is dropped
+    ~Coprocess();
+
+    Coprocess(const Coprocess &) = delete;
+    Coprocess &operator=(const Coprocess &) = delete;
+
+    // Sends request, returns the response without the delimiter
+    string request(std::string_view request);
+    // False once it exited or a request failed, the next request then starts it again
+    bool alive() const;
+    // Kills it and starts it again
+    void restart();
+};
+
+// Coprocesses of the same subprocess shared by any number of threads,
+// a request goes to an idle one, or waits until there is one
+class CoprocessPool
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    vector<std::unique_ptr<Coprocess>> coprocesses;
+    vector<Coprocess *> idle;
+
+  public:
+    CoprocessPool(
+        const subprocess &sub, size_t size = std::thread::hardware_concurrency(), char delimiter = '\n',
+        const Environment &env = Environment::global
+    );
+
+    CoprocessPool(const CoprocessPool &) = delete;
+    CoprocessPool &operator=(const CoprocessPool &) = delete;
+
+    // See Coprocess::request()
+    string request(std::string_view request);
+    size_t size() const;
+};
+
+// Run the independent steps of a script concurrently
+int run(const script &script, Environment &env, const ParallelOptions &options);
+int run(const script &script, const Environment &env, const ParallelOptions &options);
+
+// Pipelines written out in full at compile time, e.g. fixed::cmd<"ls"> | fixed::cmd<"sort">
+// Every expression is an empty type, its subprocess tree is built once, on first use, and then shared
+// (exec and echo are macros, so their counterparts here are cmd and text)
+namespace fixed
+{
+// A string literal as a template argument
+template <size_t N>
+struct Literal
+{
+    char value[N];
+
+    constexpr Literal(const char (&str)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+            value[i] = str[i];
+    }
+};
+
+template <typename E>
+struct Node
+{
+    // The subprocess of this expression, the same for every use of the type
+    static const subprocess &get()
+    {
+        static const subprocess sub = E::build();
+        return sub;
+    }
+
+    operator subprocess() const
+    {
+        return get();
+    }
+};
+
+template <typename E>
+concept Expression = std::is_base_of_v<Node<E>, E>;
+
+template <Literal... Args>
+struct Cmd : Node<Cmd<Args...>>
+{
+    static_assert(sizeof...(Args) > 0, "No command to execute");
+
+    static subprocess build()
+    {
+        return make_subprocess<::subprocess::Exec>(string(Args.value)...);
+    }
+};
+
+template <Literal... Args>
+struct Text : Node<Text<Args...>>
+{
+    static subprocess build()
+    {
+        return make_subprocess<::subprocess::Echo>(string(Args.value)...);
+    }
+};
+
+template <Literal Name>
+struct Read : Node<Read<Name>>
+{
+    static subprocess build()
+    {
+        return ::subprocess::read(Name.value);
+    }
+};
+
+template <bool Value>
+struct Bool : Node<Bool<Value>>
+{
+    static subprocess build()
+    {
+        return Value ? ::subprocess::true_ : ::subprocess::false_;
+    }
+};
+
+template <Expression L, Expression R>
+struct Pipe : Node<Pipe<L, R>>
+{
+    static subprocess build()
+    {
+        return L::get() | R::get();
+    }
+};
+
+template <Expression L, Expression R>
+struct And : Node<And<L, R>>
+{
+    static subprocess build()
+    {
+        return L::get() && R::get();
+    }
+};
+
+template <Expression L, Expression R>
+struct Or : Node<Or<L, R>>
+{
+    static subprocess build()
+    {
+        return L::get() || R::get();
+    }
+};
+
+// Execute a command
+template <Literal... Args>
+constexpr Cmd<Args...> cmd{};
+// Echo the strings
+template <Literal... Args>
+constexpr Text<Args...> text{};
+// Read stdout into a variable
+template <Literal Name>
+constexpr Read<Name> read{};
+
+constexpr Bool<true> true_{};
+constexpr Bool<false> false_{};
+
+template <Expression L, Expression R>
+constexpr Pipe<L, R> operator|(L, R)
+{
+    return {};
+}
+
+template <Expression L, Expression R>
+constexpr And<L, R> operator&&(L, R)
+{
+    return {};
+}
+
+template <Expression L, Expression R>
+constexpr Or<L, R> operator||(L, R)
+{
+    return {};
+}
+} // namespace fixed
+
 namespace dev
 {
 extern const string null;
@@ -0,0 +1,357 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <fcntl.h>
+#include <mntent.h>
+#include <sys/stat.h>
+#include <memory>
+#include <unistd.h>
+
+#include "subprocess.h"
+
+using namespace subprocess;
+
+static const Launcher &bench_launcher(int64_t index) {
+  // Created on first use, before the ballast of the run that needs it
+  static Zygote zygote{};
+  const Launcher *launchers[] = {&Launcher::Fork, &Launcher::VFork,
+                                 &Launcher::PosixSpawn, &zygote};
+  return *launchers[index];
+}
+
+// Launches per second of exec("true") for each launcher, with the
+// resident set of the parent grown by range(1) MiB
+static void BM_Launch(benchmark::State &state) {
+  const Launcher &launcher = bench_launcher(state.range(0));
+  size_t rss = static_cast<size_t>(state.range(1)) << 20;
+  std::unique_ptr<char[]> ballast(new char[rss + 1]);
+  memset(ballast.get(), 1, rss + 1);
+  benchmark::DoNotOptimize(ballast.get());
+
+  Environment env{};
+  env.set_launcher(launcher);
+  subprocess::subprocess sub = exec("true");
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  state.counters["launches"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Launch)
+    ->ArgNames({"launcher", "rss_mib"})
+    ->ArgsProduct({{0, 1, 2, 3}, {0, 256, 1024}})
+    ->UseRealTime();
+
+// exec("true") from a parent holding range(1) more fds without O_CLOEXEC,
+// which leak into the child unless close_fds is range(0)
+static void BM_LaunchFds(benchmark::State &state) {
+  std::vector<int> fds;
+  for (int64_t i = 0; i < state.range(1); i++)
+    fds.push_back(::open("/dev/null", O_RDONLY));
+
+  Environment env{};
+  env.set_launcher(Launcher::VFork);
+  env.set_launch_options({.close_fds = state.range(0) != 0});
+  subprocess::subprocess sub = exec("true");
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  for (int fd : fds)
+    close(fd);
+}
+BENCHMARK(BM_LaunchFds)
+    ->ArgNames({"close_fds", "fds"})
+    ->ArgsProduct({{0, 1}, {0, 10000}})
+    ->UseRealTime();
+
+// Where the cgroup v2 hierarchy is mounted, /sys/fs/cgroup or /sys/fs/cgroup/unified, empty without one
+static string cgroup2_mount() {
+  string path{};
+  FILE *mounts = setmntent("/proc/self/mounts", "r");
+  if (!mounts)
+    return path;
+  while (struct mntent *entry = getmntent(mounts)) {
+    if (strcmp(entry->mnt_type, "cgroup2") == 0) {
+      path = entry->mnt_dir;
+      break;
+    }
+  }
+  endmntent(mounts);
+  return path;
+}
+
+// exec("true") with Fork or VFork, without a profile, with a CPU, nice and rlimit one, or in a cgroup
+static void BM_LaunchProfile(benchmark::State &state) {
+  Environment env{};
+  env.set_launcher(state.range(0) ? Launcher::VFork : Launcher::Fork);
+  string mount = cgroup2_mount();
+  string cgroup = mount + "/subprocess_bench";
+  if (state.range(1) == 1)
+    env.set_launch_options({.cpus = {0}, .rlimits = {{RLIMIT_NOFILE, {1024, 1024}}}, .nice = 1});
+  if (state.range(1) == 2) {
+    if (mount.empty() || (mkdir(cgroup.c_str(), 0755) && errno != EEXIST)) {
+      state.SkipWithError("No writable cgroup v2 hierarchy");
+      return;
+    }
+    env.set_launch_options({.cgroup = cgroup});
+  }
+  subprocess::subprocess sub = exec("true");
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  if (state.range(1) == 2)
+    rmdir(cgroup.c_str());
+}
+BENCHMARK(BM_LaunchProfile)
+    ->ArgNames({"vfork", "profile"})
+    ->ArgsProduct({{0, 1}, {0, 1, 2}})
+    ->UseRealTime();
+
+// Latency of a single exec("true") with the default launcher
+static void BM_ExecTrue(benchmark::State &state) {
+  subprocess::subprocess sub = exec("true");
+  for (auto _ : state)
+    benchmark::DoNotOptimize(run(sub));
+}
+BENCHMARK(BM_ExecTrue)->UseRealTime();
+
+// A LongPipe style pipeline of range(0) cat stages
+static void BM_LongPipe(benchmark::State &state) {
+  subprocess::subprocess sub = exec("ls", "/etc");
+  for (int64_t i = 0; i < state.range(0); i++)
+    sub = sub | exec("cat");
+  sub = sub > dev::null;
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(run(sub));
+}
+BENCHMARK(BM_LongPipe)->ArgName("stages")->RangeMultiplier(4)->Range(1, 64)->UseRealTime();
+
+// echo | read round trip of range(0) bytes
+static void BM_EchoRead(benchmark::State &state) {
+  Environment env{};
+  subprocess::subprocess sub = echo(string(state.range(0), 'x')) | read("out");
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EchoRead)->ArgName("bytes")->RangeMultiplier(32)->Range(1, 1 << 30)->UseRealTime();
+
+// grep | cut | wc -l over range(1) lines through the commands or the in-process filters
+static void BM_Filters(benchmark::State &state) {
+  Environment env{};
+  string text{};
+  for (int64_t i = 0; i < state.range(1); i++)
+    text += "key" + std::to_string(i % 10) + "=value\n";
+  env.run(memory(text) | read("text"));
+
+  subprocess::subprocess sub =
+      state.range(0) ? echo(${"text"}) | grep("key1") | cut('=', 2) | wc() | read("out")
+                     : echo(${"text"}) | exec("grep", "-F", "key1") | exec("cut", "-d=", "-f2") |
+                           exec("wc", "-l") | read("out");
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Filters)
+    ->ArgNames({"builtin", "lines"})
+    ->ArgsProduct({{0, 1}, {10, 100000}})
+    ->UseRealTime();
+
+// Feeding range(1) bytes to the stdin of sort with echo or memory(), which uses a memfd up to Memory::max_size
+static void BM_FeedStdin(benchmark::State &state) {
+  Environment env{};
+  string input(state.range(1), 'x');
+  subprocess::subprocess source = state.range(0) ? memory(input) : echo(input);
+  subprocess::subprocess sub = source | exec("sort") > dev::null;
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_FeedStdin)
+    ->ArgNames({"memory", "bytes"})
+    ->ArgsProduct({{0, 1}, {1 << 10, 1 << 20, 1 << 28}})
+    ->UseRealTime();
+
+// range(2) bytes to range(1) wc -c and to stdout, through fanout() or the tee of a shell
+static void BM_Fanout(benchmark::State &state) {
+  Environment env{};
+  string bytes = std::to_string(state.range(2));
+  vector<subprocess::subprocess> outputs{};
+  string script = "tee";
+  for (int64_t i = 0; i < state.range(1); i++) {
+    outputs.push_back(exec("wc", "-c") > dev::null);
+    script += " >(wc -c >/dev/null)";
+  }
+  subprocess::subprocess source = exec("head", "-c", bytes, dev::zero);
+  subprocess::subprocess sub = state.range(0) ? source | fanout(outputs) | exec("wc", "-c") > dev::null
+                                              : source | exec("bash", "-c", script) | exec("wc", "-c") > dev::null;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+
+  state.SetBytesProcessed(state.iterations() * state.range(2) * (state.range(1) + 1));
+}
+BENCHMARK(BM_Fanout)
+    ->ArgNames({"builtin", "outputs", "bytes"})
+    ->ArgsProduct({{0, 1}, {1, 4}, {1 << 20, 1 << 28}})
+    ->UseRealTime();
+
+// uname -r into a variable, started every time or replayed by cached()
+static void BM_Cached(benchmark::State &state) {
+  Environment env{};
+  subprocess::subprocess uname = exec("uname", "-r");
+  subprocess::subprocess sub = (state.range(0) ? cached(uname, std::chrono::hours(1)) : uname) | read("out");
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+}
+BENCHMARK(BM_Cached)->ArgName("cached")->Arg(0)->Arg(1)->UseRealTime();
+
+static Executor &bench_executor(int64_t index) {
+  static ThreadPool pool{};
+  static EventLoop loop{};
+  static Uring uring{};
+  Executor *executors[] = {&Executor::Threads, &pool, &loop, &uring};
+  return *executors[index];
+}
+
+// true_ && true_ && ... of depth range(1) on each executor
+static void BM_AndChain(benchmark::State &state) {
+  Environment env{};
+  env.set_executor(bench_executor(state.range(0)));
+  subprocess::subprocess sub = true_;
+  for (int64_t i = 1; i < state.range(1); i++)
+    sub = sub && true_;
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+}
+BENCHMARK(BM_AndChain)
+    ->ArgNames({"executor", "depth"})
+    ->ArgsProduct({{0, 1, 2, 3}, {1, 10, 100, 1000}})
+    ->UseRealTime();
+
+// false_ || false_ || ... || true_ of depth range(1) on each executor
+static void BM_OrChain(benchmark::State &state) {
+  Environment env{};
+  env.set_executor(bench_executor(state.range(0)));
+  subprocess::subprocess sub = false_;
+  for (int64_t i = 2; i < state.range(1); i++)
+    sub = sub || false_;
+  sub = sub || true_;
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(env.run(sub));
+}
+BENCHMARK(BM_OrChain)
+    ->ArgNames({"executor", "depth"})
+    ->ArgsProduct({{0, 1, 2, 3}, {1, 10, 100, 1000}})
+    ->UseRealTime();
+
+// range(1) pipelines of echo | cat | read running at once on each executor
+static void BM_ManyPipelines(benchmark::State &state) {
+  Executor &executor = bench_executor(state.range(0));
+  Environment env{};
+  env.set_executor(executor);
+  std::vector<Environment> envs(state.range(1), env);
+  subprocess::subprocess sub = echo("x") | exec("cat") | read("out");
+
+  for (auto _ : state) {
+    JobSet jobs{executor};
+    for (Environment &e : envs)
+      jobs.add(spawn(sub, e));
+    benchmark::DoNotOptimize(jobs.wait_all());
+  }
+}
+BENCHMARK(BM_ManyPipelines)
+    ->ArgNames({"executor", "pipelines"})
+    ->ArgsProduct({{1, 2, 3}, {10, 100, 500}})
+    ->UseRealTime();
+
+// range(1) copies of cat, each given an input and read back, spawned as echo | cat | read on an EventLoop
+// or with run_batch()
+static void BM_Batch(benchmark::State &state) {
+  Executor &executor = bench_executor(2);
+  Environment env{};
+  env.set_executor(executor);
+  std::vector<Environment> envs(state.range(1), env);
+  vector<string> inputs(state.range(1), "x");
+  subprocess::subprocess sub = echo("x") | exec("cat") | read("out");
+
+  for (auto _ : state) {
+    if (state.range(0)) {
+      benchmark::DoNotOptimize(run_batch(exec("cat"), inputs, inputs.size(), env));
+      continue;
+    }
+    JobSet jobs{executor};
+    for (Environment &e : envs)
+      jobs.add(spawn(sub, e));
+    benchmark::DoNotOptimize(jobs.wait_all());
+  }
+}
+BENCHMARK(BM_Batch)->ArgNames({"batch", "copies"})->ArgsProduct({{0, 1}, {10, 100, 500}})->UseRealTime();
+
+// One record through cat, started for it or kept running as a Coprocess
+static void BM_Coprocess(benchmark::State &state) {
+  Environment env{};
+  subprocess::subprocess cat = exec("cat");
+  subprocess::subprocess once = cat << "record\n" | read("out");
+  Coprocess coprocess{cat};
+  for (auto _ : state) {
+    if (state.range(0))
+      benchmark::DoNotOptimize(coprocess.request("record"));
+    else
+      benchmark::DoNotOptimize(env.run(once));
+  }
+}
+BENCHMARK(BM_Coprocess)->ArgName("coprocess")->Arg(0)->Arg(1)->UseRealTime();
+
+// Building a pipeline of range(0) stages through the operators
+static void BM_BuildPipe(benchmark::State &state) {
+  for (auto _ : state) {
+    subprocess::subprocess sub = echo("x");
+    for (int64_t i = 0; i < state.range(0); i++)
+      sub = sub | exec("cat", "-");
+    benchmark::DoNotOptimize(sub);
+  }
+}
+BENCHMARK(BM_BuildPipe)->ArgName("stages")->RangeMultiplier(10)->Range(1, 1000);
+
+// Building a script of range(0) steps joined with &&
+static void BM_BuildAnd(benchmark::State &state) {
+  for (auto _ : state) {
+    subprocess::subprocess sub = true_;
+    for (int64_t i = 0; i < state.range(0); i++)
+      sub = sub && (echo(${"x"}) | read("x"));
+    benchmark::DoNotOptimize(sub);
+  }
+}
+BENCHMARK(BM_BuildAnd)->ArgName("steps")->RangeMultiplier(10)->Range(1, 1000);
+
+// An Environment per request: copy one and look a variable up in it
+static void BM_CopyEnvironment(benchmark::State &state) {
+  Environment base{};
+  for (auto _ : state) {
+    Environment env{base};
+    benchmark::DoNotOptimize(${"PATH"}.get(env));
+  }
+}
+BENCHMARK(BM_CopyEnvironment);
+
+// Getting the tree of a fixed pipeline, built on first use, against building it every time
+static void BM_BuildFixed(benchmark::State &state) {
+  for (auto _ : state) {
+    subprocess::subprocess sub = state.range(0)
+        ? subprocess::subprocess(fixed::text<"x"> | fixed::cmd<"cat", "-"> | fixed::cmd<"sort">)
+        : echo("x") | exec("cat", "-") | exec("sort");
+    benchmark::DoNotOptimize(sub);
+  }
+}
+BENCHMARK(BM_BuildFixed)->ArgName("fixed")->DenseRange(0, 1);
@@ -1,5 +1,11 @@
 #include <gtest/gtest.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <future>
+#include <thread>
+#include <unistd.h>
+
 #include "subprocess.h"
 
 using namespace subprocess;
@@ -35,6 +41,12 @@ TEST(SubprocessTest, EchoRead) {
   ASSERT_TRUE(!env.run(echo(${"test1"}, ${"test2"}, test3, "?") | read("out")));
   ASSERT_STREQ((test1 + " " + test2 + " " + test3 + " ?").c_str(),
                ${"out"}.get(env).c_str());
+
+  ASSERT_TRUE(!env.run(echo("", test1, "", "") | read("out")));
+  ASSERT_EQ(" " + test1 + "  ", ${"out"}.get(env));
+
+  ASSERT_TRUE(!env.run(echo() | exec("wc", "-c") | read("out")));
+  ASSERT_STREQ("1", ${"out"}.get(env).c_str());
 }
 
 TEST(SubprocessTest, ShortCircuitAnd) {
@@ -68,3 +80,1153 @@ TEST(SubprocessTest, LongPipe) {
                    exec("cut", "-d.", "-f1") | exec("rev") | exec("sort") |
                    (exec("uniq", "-c") > dev::null)));
 }
+
+TEST(SubprocessTest, Launchers) {
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn}) {
+    Environment env{};
+    env.set_launcher(*launcher);
+    ASSERT_TRUE(!env.run(exec("echo", "launched") | exec("rev") | read("out")));
+    ASSERT_STREQ("dehcnual", ${"out"}.get(env).c_str());
+    ASSERT_EQ(1, env.run(exec("false")));
+    ASSERT_EQ(ENOENT, env.run(exec("/nonexistent/command")));
+  }
+}
+
+TEST(SubprocessTest, Zygote) {
+  Zygote zygote{};
+  Environment env{};
+  env.set_launcher(zygote);
+  ASSERT_TRUE(!env.run(exec("echo", "launched") | exec("rev") | read("out")));
+  ASSERT_STREQ("dehcnual", ${"out"}.get(env).c_str());
+  ASSERT_EQ(1, env.run(exec("false")));
+  ASSERT_EQ(ENOENT, env.run(exec("/nonexistent/command")));
+
+  // The environment and the streams are passed over the socket
+  ASSERT_TRUE(!env.run(echo("zygote") | read("PATH")));
+  ASSERT_TRUE(!env.run(exec("/usr/bin/printenv", "PATH") | read("out")));
+  ASSERT_STREQ("zygote", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run((exec("/bin/cat") << "in") | read("out")));
+  ASSERT_STREQ("in", ${"out"}.get(env).c_str());
+
+  // Children of the helper are children of this process
+  runsubprocess running = exec("/bin/sh", "-c", "echo $PPID")->start({.out = Streams::New}, env);
+  int fd = running->get_streams().out;
+  char buf[64];
+  string ppid;
+  for (ssize_t count; (count = ::read(fd, buf, sizeof(buf))) > 0;)
+    ppid.append(buf, count);
+  close(fd);
+  ASSERT_EQ(std::to_string(getpid()) + "\n", ppid);
+  ASSERT_EQ(0, running->wait());
+
+  // Launches from several threads share the helper
+  std::vector<std::future<int>> runs;
+  for (int i = 0; i < 8; i++)
+    runs.push_back(std::async(std::launch::async, [&env] {
+      return env.run(exec("/bin/true") && exec("/bin/true"));
+    }));
+  for (auto &run : runs)
+    ASSERT_EQ(0, run.get());
+
+  // One made while other threads allocate, its helper doesn't, and reuses its buffers for any request
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> allocating;
+  for (int i = 0; i < 4; i++)
+    allocating.emplace_back([&stop] {
+      while (!stop)
+        std::vector<string>(64, string(100, 'x')).swap(*std::make_unique<std::vector<string>>());
+    });
+  for (int i = 0; i < 20; i++) {
+    Zygote busy{};
+    Environment launched{};
+    launched.set_launcher(busy);
+    ASSERT_TRUE(!launched.run(exec("echo", string(i * 1000, 'a')) | exec("wc", "-c") | read("out")));
+    ASSERT_EQ(std::to_string(i * 1000 + 1), ${"out"}.get(launched));
+    ASSERT_TRUE(!launched.run(exec("true")));
+  }
+  stop = true;
+  for (std::thread &thread : allocating)
+    thread.join();
+  ASSERT_THROW(env.run(exec("true", string(4 << 20, 'a'))), std::system_error);
+}
+
+TEST(SubprocessTest, LaunchFds) {
+  Zygote zygote{};
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+    Environment env{};
+    env.set_launcher(*launcher);
+
+    // An fd without O_CLOEXEC leaks, unless close_fds, the helper of a Zygote never had it
+    int leak = ::open("/dev/null", O_RDONLY);
+    ASSERT_GE(leak, 3);
+    subprocess::subprocess check = exec("test", "-e", "/proc/self/fd/" + std::to_string(leak));
+    ASSERT_EQ(launcher == &zygote ? 1 : 0, env.run(check));
+    env.set_launch_options({.close_fds = true});
+    ASSERT_EQ(1, env.run(check));
+    close(leak);
+
+    // Kept fds get through with their numbers, O_CLOEXEC or not
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_CLOEXEC));
+    env.set_launch_options({.close_fds = true, .keep_fds = {fds[1]}});
+    ASSERT_EQ(0, env.run(exec("sh", "-c", "echo kept >&" + std::to_string(fds[1]))));
+    close(fds[1]);
+    char buf[16];
+    ASSERT_EQ(5, ::read(fds[0], buf, sizeof(buf)));
+    close(fds[0]);
+    ASSERT_EQ("kept\n", string(buf, 5));
+
+    // Also the fds below a kept one are closed
+    leak = ::open("/dev/null", O_RDONLY);
+    ASSERT_EQ(1000, dup2(leak, 1000));
+    env.set_launch_options({.close_fds = true, .keep_fds = {1000}});
+    ASSERT_EQ(0, env.run(exec("sh", "-c", "test -e /proc/self/fd/1000 && ! test -e /proc/self/fd/" +
+                                              std::to_string(leak))));
+    close(leak);
+    close(1000);
+  }
+  Environment env{};
+  ASSERT_THROW(env.set_launch_options({.keep_fds = {STDOUT_FILENO}}), std::invalid_argument);
+}
+
+TEST(SubprocessTest, LaunchProfiles) {
+  LaunchOptions options{
+      .cpus = {0}, .rlimits = {{RLIMIT_NOFILE, {64, 64}}}, .nice = 5, .io_class = 3, .io_level = 0};
+  subprocess::subprocess show =
+      exec("sh", "-c", "grep Cpus_allowed_list /proc/self/status | cut -f2; ulimit -n; nice; ionice") | read("out");
+
+  // Every launcher applies them, the parent isn't changed
+  Zygote zygote{};
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+    Environment env{};
+    env.set_launcher(*launcher);
+    env.set_launch_options(options);
+    ASSERT_TRUE(!env.run(show));
+    ASSERT_STREQ("0\n64\n5\nidle", ${"out"}.get(env).c_str());
+
+    // A child that can't get them fails like one that can't exec
+    env.set_launch_options({.rlimits = {{RLIMIT_NOFILE, {100, 10}}}});
+    ASSERT_EQ(EINVAL, env.run(exec("true")));
+  }
+  ASSERT_EQ(0, getpriority(PRIO_PROCESS, 0));
+
+  // Or only for a part of a pipeline
+  Environment env{};
+  ASSERT_TRUE(!env.run(profile(exec("nice"), {.nice = 7}) | read("out")));
+  ASSERT_STREQ("7", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("x") | profile(exec("sh", "-c", "cat; nice"), {.nice = 7}) | exec("cat") | read("out")));
+  ASSERT_STREQ("x\n7", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(exec("nice") | read("out")));
+  ASSERT_STREQ("0", ${"out"}.get(env).c_str());
+
+  // A whole pipeline, its variables are set in env
+  ASSERT_TRUE(!env.run(profile(exec("nice") | exec("cat") | read("n") && exec("nice") | read("m"), {.nice = 5})));
+  ASSERT_STREQ("5", ${"n"}.get(env).c_str());
+  ASSERT_STREQ("5", ${"m"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(profile(exec("nice") | read("n"), {.nice = 3}) && exec("test", ${"n"}, "=", "3")));
+
+  // A NUMA node is turned into its CPUs
+  env.set_launch_options({.numa_node = 0});
+  ASSERT_TRUE(!env.run(exec("sh", "-c", "grep Cpus_allowed_list /proc/self/status | cut -f2") | read("out")));
+  ASSERT_TRUE(!env.run(exec("cat", "/sys/devices/system/node/node0/cpulist") | read("node")));
+  ASSERT_EQ(${"node"}.get(env), ${"out"}.get(env));
+  ASSERT_THROW(env.set_launch_options({.numa_node = 100000}), std::invalid_argument);
+  ASSERT_THROW(env.set_launch_options({.cpus = {-1}}), std::invalid_argument);
+  ASSERT_THROW(env.set_launch_options({.io_class = 4}), std::invalid_argument);
+
+  // Where a cgroup v2 hierarchy can be written to, the child starts in the given cgroup
+  string root = access("/sys/fs/cgroup/cgroup.procs", F_OK) == 0 ? "" : "/unified";
+  string name = root + "/subprocess_test_" + std::to_string(getpid());
+  if (mkdir(("/sys/fs/cgroup" + name).c_str(), 0755) == 0) {
+    for (const Launcher *launcher :
+         {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+      Environment confined{};
+      confined.set_launcher(*launcher);
+      confined.set_launch_options({.cgroup = "/sys/fs/cgroup" + name});
+      ASSERT_TRUE(!confined.run(exec("grep", "^0::", "/proc/self/cgroup") | read("out")));
+      ASSERT_EQ("0::" + name.substr(root.size()), ${"out"}.get(confined));
+    }
+    ASSERT_EQ(0, rmdir(("/sys/fs/cgroup" + name).c_str()));
+  }
+  env.set_launch_options({.cgroup = "/nonexistent"});
+  ASSERT_THROW(env.run(exec("true")), std::system_error);
+}
+
+TEST(SubprocessTest, ExportedEnvironment) {
+  Environment env{};
+  ASSERT_TRUE(!env.run(exec("printenv", "PATH") | read("path")));
+  ASSERT_STREQ(getenv("PATH"), ${"path"}.get(env).c_str());
+
+  // Changing an exported variable is seen by the next child
+  ASSERT_TRUE(!env.run(echo("/bin:/usr/bin") | read("PATH")));
+  ASSERT_TRUE(!env.run(exec("printenv", "PATH") | read("path")));
+  ASSERT_STREQ("/bin:/usr/bin", ${"path"}.get(env).c_str());
+
+  // A new variable is not exported
+  ASSERT_TRUE(!env.run(echo("value") | read("NOT_EXPORTED")));
+  ASSERT_FALSE(!env.run(exec("printenv", "NOT_EXPORTED") > dev::null));
+}
+
+TEST(SubprocessTest, CopyOnWrite) {
+  Environment env{};
+  ASSERT_TRUE(!env.run(echo("parent") | read("var")));
+
+  // Copies share the variables until one of them changes
+  Environment child{env};
+  ASSERT_STREQ("parent", ${"var"}.get(child).c_str());
+  ASSERT_TRUE(!child.run(echo("child") | read("var")));
+  ASSERT_STREQ("child", ${"var"}.get(child).c_str());
+  ASSERT_STREQ("parent", ${"var"}.get(env).c_str());
+
+  // Many layers deep, an overridden exported variable is passed once
+  Environment deep{env};
+  for (int i = 0; i < 20; i++) {
+    Environment next{deep};
+    ASSERT_TRUE(!next.run(echo(std::to_string(i)) | read("PATH")));
+    deep = next;
+  }
+  ASSERT_TRUE(!deep.run(exec("printenv", "PATH") | read("path")));
+  ASSERT_STREQ("19", ${"path"}.get(deep).c_str());
+  ASSERT_TRUE(!deep.run(exec("/usr/bin/env") | read("all")));
+  string all = "\n" + ${"all"}.get(deep);
+  ASSERT_NE(string::npos, all.find("\nPATH=19"));
+  ASSERT_EQ(all.find("\nPATH="), all.rfind("\nPATH="));
+  ASSERT_STREQ(getenv("PATH"), ${"PATH"}.get(env).c_str());
+
+  ASSERT_THROW(${"UNSET_VARIABLE"}.get(env), std::out_of_range);
+}
+
+TEST(SubprocessTest, ParallelScript) {
+  Environment env{};
+
+  // Independent steps overlap: each one leaves a mark and waits, for up to 10 s, until all four have
+  ASSERT_TRUE(!env.run(exec("mktemp", "-d") | read("dir")));
+  string barrier = "touch \"$0/$1\"; for i in $(seq 100); do [ $(ls \"$0\" | wc -l) -ge 4 ] && exit 0; "
+                   "sleep 0.1; done; exit 1";
+  script sleeps = make_script(exec("sh", "-c", barrier, ${"dir"}, "a"), exec("sh", "-c", barrier, ${"dir"}, "b"),
+                              exec("sh", "-c", barrier, ${"dir"}, "c"), exec("sh", "-c", barrier, ${"dir"}, "d"));
+  ASSERT_EQ(0, env.run(sleeps, {.jobs = 4}));
+  ASSERT_TRUE(!env.run(exec("rm", "-r", ${"dir"})));
+
+  // Steps using the same variables keep their order
+  script steps = make_script(
+      exec("sleep", "0.1") && (echo("first") | read("x")),
+      echo(${"x"}) | read("y"),
+      echo("second") | read("x"),
+      echo("other") | read("z"));
+  Variables uses;
+  steps[1]->get_variables(uses);
+  ASSERT_EQ(std::vector<string>{"x"}, uses.reads);
+  ASSERT_EQ(std::vector<string>{"y"}, uses.writes);
+  ASSERT_EQ(0, env.run(steps, {}));
+  ASSERT_STREQ("first", ${"y"}.get(env).c_str());
+  ASSERT_STREQ("second", ${"x"}.get(env).c_str());
+  ASSERT_STREQ("other", ${"z"}.get(env).c_str());
+
+  // Nothing depending on a failure runs, unrelated steps only with keep_going
+  script failing = make_script(false_, echo("1") | read("dependent"),
+                               exec("sleep", "0.1") && (echo("1") | read("unrelated")));
+  Environment stops{};
+  ASSERT_NE(0, stops.run(failing, {.jobs = 1, .after = {{1, 0}}}));
+  ASSERT_THROW(${"dependent"}.get(stops), std::out_of_range);
+  ASSERT_THROW(${"unrelated"}.get(stops), std::out_of_range);
+  Environment keeps{};
+  ASSERT_NE(0, keeps.run(failing, {.jobs = 1, .keep_going = true, .after = {{1, 0}}}));
+  ASSERT_THROW(${"dependent"}.get(keeps), std::out_of_range);
+  ASSERT_STREQ("1", ${"unrelated"}.get(keeps).c_str());
+
+  ASSERT_THROW(env.run(sleeps, {.after = {{0, 1}, {1, 0}}}), std::invalid_argument);
+}
+
+TEST(SubprocessTest, JobSet) {
+  EventLoop loop{1};
+  JobSet jobs{loop};
+  size_t slow = jobs.add(spawn(exec("sleep", "0.3")));
+  size_t fast = jobs.add(spawn(exec("sleep", "0.05") && exec("false")));
+  ASSERT_EQ(2u, jobs.size());
+  ASSERT_FALSE(jobs.try_wait_any());
+  auto first = jobs.wait_any();
+  ASSERT_EQ(fast, first.first);
+  ASSERT_NE(0, first.second);
+  ASSERT_EQ(std::make_pair(slow, 0), jobs.wait_any());
+  ASSERT_THROW(jobs.wait_any(), std::logic_error);
+
+  // Keep two workers busy until every task is done
+  Environment env{};
+  JobSet workers{};
+  int started = 0, done = 0;
+  while (done < 6) {
+    while (started < 6 && workers.size() < 2) {
+      workers.add(spawn(exec("sleep", "0.02") | read("out"), env));
+      started++;
+    }
+    ASSERT_EQ(0, workers.wait_any().second);
+    done++;
+  }
+  ASSERT_EQ(0u, workers.size());
+
+  // Jobs left running are waited for
+  JobSet left{};
+  left.add(spawn(exec("true")));
+  ASSERT_EQ(0, left.wait_all());
+}
+
+TEST(SubprocessTest, Batch) {
+  string big(1 << 20, 'x');
+  Zygote zygote{};
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+    Environment env{};
+    env.set_launcher(*launcher);
+
+    // Results come back in the order of the inputs, whichever order the copies finish in
+    vector<BatchResult> results = run_batch(exec("sh", "-c", "read n; sleep 0.0$n; echo $n; exit $n"),
+                                            {"5", "1", "3", "0"}, 0, env);
+    ASSERT_EQ(4u, results.size());
+    for (size_t i = 0; i < 4; i++) {
+      ASSERT_EQ(string("5130").substr(i, 1) + "\n", results[i].out);
+      ASSERT_EQ("5130"[i] - '0', results[i].ret);
+    }
+
+    // More inputs than run at once, a pipeline, big and empty inputs
+    vector<string> inputs(20, "abc");
+    inputs[3] = big;
+    inputs[7] = "";
+    results = run_batch(exec("rev") | exec("tr", "a-z", "A-Z"), inputs, 3, env);
+    for (size_t i = 0; i < inputs.size(); i++) {
+      ASSERT_EQ(0, results[i].ret);
+      ASSERT_EQ(i == 3 ? string(1 << 20, 'X') : i == 7 ? "" : "CBA", results[i].out);
+    }
+  }
+
+  // A copy not reading its input, builtins in the copies and a program that can't run
+  vector<BatchResult> results = run_batch(exec("true"), {big, big});
+  ASSERT_EQ(0, results[0].ret + results[1].ret);
+  results = run_batch(exec("cat") | grep("b") | head(1), {"a\nb1\nb2\n", "c\n"});
+  ASSERT_EQ("b1\n", results[0].out);
+  ASSERT_EQ("", results[1].out);
+  results = run_batch(exec("/nonexistent"), {"x"});
+  ASSERT_EQ(ENOENT, results[0].ret);
+  ASSERT_TRUE(run_batch(exec("true"), {}).empty());
+  ASSERT_THROW(run_batch(read("x"), {"x"}), std::invalid_argument);
+
+  // start_many() passes a given fd to every copy
+  for (subprocess::subprocess sub : {exec("echo", "x"), exec("echo", "x") | exec("cat")}) {
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_CLOEXEC));
+    vector<runsubprocess> runs = sub->start_many(3, {.out = fds[1]});
+    for (runsubprocess &running : runs)
+      ASSERT_EQ(0, running->wait());
+    char buf[16];
+    ASSERT_EQ(6, ::read(fds[0], buf, sizeof(buf)));
+    ASSERT_EQ("x\nx\nx\n", string(buf, 6));
+    ASSERT_EQ(0, ::read(fds[0], buf, sizeof(buf)));
+    close(fds[0]);
+  }
+}
+
+TEST(SubprocessTest, Coprocess) {
+  Coprocess quote{exec("sh", "-c", "while read l; do echo \"<$l>\"; done")};
+  ASSERT_EQ("<a>", quote.request("a"));
+  ASSERT_EQ("<b c>", quote.request("b c"));
+  ASSERT_TRUE(quote.alive());
+
+  // A big request is written while the response is read
+  Coprocess cat{exec("cat")};
+  string big(1 << 20, 'x');
+  ASSERT_TRUE(big == cat.request(big));
+  ASSERT_EQ("", cat.request(""));
+
+  // Other delimiters and pipelines
+  Coprocess nul{exec("cat") | exec("cat"), '\0'};
+  ASSERT_EQ("a\nb", nul.request("a\nb"));
+
+  // A coprocess that exited is started again, one exiting during a request throws
+  Coprocess once{exec("sh", "-c", "read l; echo $l")};
+  ASSERT_EQ("1", once.request("1"));
+  while (once.alive())
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ("2", once.request("2"));
+  Coprocess quits{exec("sh", "-c", "read l; exit 1")};
+  ASSERT_THROW(quits.request("x"), std::system_error);
+  ASSERT_FALSE(quits.alive());
+  ASSERT_THROW(quits.request("x"), std::system_error);
+  quote.restart();
+  ASSERT_EQ("<c>", quote.request("c"));
+
+  // Output nobody reads doesn't keep it from ending
+  {
+    Coprocess talkative{exec("sh", "-c", "while read l; do seq 200000; done")};
+    ASSERT_EQ("1", talkative.request("x"));
+  }
+
+  // Threads sharing a pool all get their own responses
+  CoprocessPool pool{exec("sh", "-c", "while read l; do echo \"<$l>\"; done"), 3};
+  ASSERT_EQ(3u, pool.size());
+  vector<std::thread> threads;
+  std::atomic<int> wrong{0};
+  for (int t = 0; t < 6; t++) {
+    threads.emplace_back([&pool, &wrong, t]() {
+      for (int i = 0; i < 50; i++) {
+        string record = std::to_string(t) + "-" + std::to_string(i);
+        if (pool.request(record) != "<" + record + ">")
+          wrong++;
+      }
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  ASSERT_EQ(0, wrong);
+  ASSERT_THROW(CoprocessPool(exec("cat"), 0), std::invalid_argument);
+}
+
+TEST(SubprocessTest, Cancellation) {
+  using clock = std::chrono::steady_clock;
+  Environment env{};
+
+  // A deadline kills the child, the pipe to the builtin closes with it
+  auto begin = clock::now();
+  {
+    Cancellation deadline{std::chrono::milliseconds(50)};
+    ASSERT_EQ(SIGKILL, run(exec("sleep", "10") | read("x"), env, deadline));
+    ASSERT_TRUE(deadline.cancelled());
+  }
+  ASSERT_LT(clock::now() - begin, std::chrono::seconds(5));
+
+  // The later stages of a cancelled chain don't start
+  Cancellation cancellation{};
+  auto cancel = std::async(std::launch::async, [&cancellation] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    cancellation.cancel();
+  });
+  begin = clock::now();
+  ASSERT_NE(0, run(exec("sleep", "0.2") && (echo("started") | read("y")), env,
+                   cancellation));
+  cancel.get();
+  ASSERT_LT(clock::now() - begin, std::chrono::seconds(5));
+  ASSERT_THROW(${"y"}.get(env), std::out_of_range);
+
+  // A cancelled script starts no more steps, later runs are cancelled at once
+  ASSERT_EQ(ECANCELED, run(script{exec("true")}, env, cancellation));
+  ASSERT_EQ(SIGTERM, run(exec("sleep", "10"), env, cancellation));
+
+  // A process group takes the grandchildren down too, else sleep would keep the pipe open
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn}) {
+    Environment group{};
+    group.set_launcher(*launcher);
+    group.set_launch_options({.process_group = true});
+    begin = clock::now();
+    Cancellation deadline{std::chrono::milliseconds(50), SIGTERM};
+    ASSERT_EQ(SIGTERM, run(exec("sh", "-c", "sleep 10; echo done") | read("x"),
+                           group, deadline));
+    ASSERT_LT(clock::now() - begin, std::chrono::seconds(5));
+  }
+  Zygote zygote{};
+  Environment group{};
+  group.set_launcher(zygote);
+  group.set_launch_options({.process_group = true});
+  Cancellation deadline{std::chrono::milliseconds(50), SIGTERM};
+  ASSERT_EQ(SIGTERM, run(exec("sh", "-c", "sleep 10; echo done") | read("x"),
+                         group, deadline));
+}
+
+TEST(SubprocessTest, Sink) {
+  std::vector<string> got;
+  auto collect = [&got](std::string_view line) {
+    got.emplace_back(line);
+    return true;
+  };
+  ASSERT_EQ(0, run(exec("printf", "a\\nbb\\n\\nccc") | lines(collect)));
+  ASSERT_EQ((std::vector<string>{"a", "bb", "", "ccc"}), got);
+
+  // Lines longer than the buffer come in pieces
+  got.clear();
+  ASSERT_EQ(0, run(echo("abcdefghij\nxy") | lines(collect, 4)));
+  ASSERT_EQ((std::vector<string>{"abcd", "efgh", "ij", "xy"}), got);
+
+  string big(1 << 20, 's');
+  size_t total = 0, largest = 0;
+  ASSERT_EQ(0, run(echo(big) | exec("cat") | sink([&](std::string_view chunk) {
+                     total += chunk.size();
+                     largest = std::max(largest, chunk.size());
+                     return true;
+                   }, 4096)));
+  ASSERT_EQ(big.size() + 1, total);
+  ASSERT_LE(largest, 4096u);
+
+  // Stopping early closes the pipe, so an endless writer ends too
+  int count = 0;
+  run(exec("yes") | lines([&count](std::string_view line) { return ++count < 3; }));
+  ASSERT_EQ(3, count);
+}
+
+TEST(SubprocessTest, Filters) {
+  Environment env{};
+  ASSERT_TRUE(!env.run(echo("a\nb\nc\nd") | head(2) | read("out")));
+  ASSERT_STREQ("a\nb", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("a\nb\nc\nd") | tail(3) | read("out")));
+  ASSERT_STREQ("b\nc\nd", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("k=1\nnone\nk=2=x") | cut('=', 2) | read("out")));
+  ASSERT_STREQ("1\nnone\n2", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("one two\n  three ") | wc(Filter::Lines | Filter::Words | Filter::Bytes) |
+                       read("out")));
+  ASSERT_STREQ("2 3 17", ${"out"}.get(env).c_str());
+
+  // Arguments can be variables, filters chain without any process
+  ASSERT_TRUE(!env.run(echo("b") | read("pattern")));
+  ASSERT_TRUE(!env.run(echo("abc\nxyz\nbcd") | grep(${"pattern"}) | wc() | read("out")));
+  ASSERT_STREQ("2", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("abc\nxyz\nbcd") | grep("b", true) | read("out")));
+  ASSERT_STREQ("xyz", ${"out"}.get(env).c_str());
+
+  // Lines longer than the pieces they're read in, and more lines than a pipe holds
+  string big;
+  for (int i = 0; i < 100000; i++)
+    big += (i ? "\n" : "") + std::to_string(i) + (i % 1000 ? "" : string(100000, 'x'));
+  env.run(memory(big) | read("big"));
+  ASSERT_TRUE(!env.run(echo(${"big"}) | tail(2) | read("out")));
+  ASSERT_STREQ("99998\n99999", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo(${"big"}) | grep("99000") | cut('x', 1) | read("out")));
+  ASSERT_STREQ("99000", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo(${"big"}) | wc() | read("out")));
+  ASSERT_STREQ("100000", ${"out"}.get(env).c_str());
+
+  // head stops reading early, a process writing on gets SIGPIPE, a builtin EPIPE
+  ASSERT_EQ(SIGPIPE, env.run(exec("yes") | head(1) | read("out")));
+  ASSERT_STREQ("y", ${"out"}.get(env).c_str());
+  // The process ignores SIGPIPE for that, its children still get the default
+  Zygote zygote{};
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+    Environment launched{};
+    launched.set_launcher(*launcher);
+    ASSERT_EQ(SIGPIPE, launched.run(exec("yes") | head(1)));
+  }
+  ASSERT_EQ(EPIPE, env.run(pipe(echo(${"big"}), head(1), {}) | read("out")));
+  ASSERT_EQ("0" + string(100000, 'x'), ${"out"}.get(env));
+
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("tmpfile")));
+  ASSERT_TRUE(!env.run(echo("teed") | tee(${"tmpfile"}) | read("out")));
+  ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+  ASSERT_TRUE(!env.run(exec("rm", ${"tmpfile"})));
+  ASSERT_STREQ("teed", ${"out"}.get(env).c_str());
+  ASSERT_STREQ("teed", ${"file"}.get(env).c_str());
+  ASSERT_THROW(env.run(echo("x") | tee("/nonexistent/file")), std::system_error);
+  // A failed write to the file is its return code
+  ASSERT_EQ(ENOSPC, env.run(echo("x") | tee("/dev/full") | read("out")));
+}
+
+TEST(SubprocessTest, Stderr) {
+  Environment env{};
+  subprocess::subprocess both = exec("sh", "-c", "echo out; echo err >&2");
+  // Captured apart, or merged into stdout like 2>&1
+  ASSERT_TRUE(!env.run(pipe_err(both, read("err")) | read("out")));
+  ASSERT_STREQ("out", ${"out"}.get(env).c_str());
+  ASSERT_STREQ("err", ${"err"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(merge_err(both) | read("out")));
+  ASSERT_STREQ("out\nerr", ${"out"}.get(env).c_str());
+  // In a pipeline it's the stderr of the last stage
+  ASSERT_TRUE(!env.run(merge_err(echo("in") | exec("sh", "-c", "cat; echo err >&2")) | read("out")));
+  ASSERT_STREQ("in\nerr", ${"out"}.get(env).c_str());
+  // Builtins write no stderr, merging it changes nothing
+  ASSERT_TRUE(!env.run(merge_err(echo("x")) | read("out")));
+  ASSERT_STREQ("x", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(merge_err(exec("echo", "out") | read("out"))));
+  ASSERT_STREQ("out", ${"out"}.get(env).c_str());
+
+  Zygote zygote{};
+  for (const Launcher *launcher :
+       {&Launcher::Fork, &Launcher::VFork, &Launcher::PosixSpawn, static_cast<const Launcher *>(&zygote)}) {
+    Environment launched{};
+    launched.set_launcher(*launcher);
+    ASSERT_TRUE(!launched.run(merge_err(both) | read("out")));
+    ASSERT_STREQ("out\nerr", ${"out"}.get(launched).c_str());
+  }
+
+  // To a file, like 2> and 2>>
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("tmpfile")));
+  ASSERT_TRUE(!env.run(err_to(both, ${"tmpfile"}) | read("out")));
+  ASSERT_TRUE(!env.run(err_to(both, ${"tmpfile"}, true) | read("out")));
+  ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+  ASSERT_STREQ("out", ${"out"}.get(env).c_str());
+  ASSERT_STREQ("err\nerr", ${"file"}.get(env).c_str());
+
+  // The same data to every output and to stdout, more than a pipe holds
+  string big;
+  for (int i = 0; i < 100000; i++)
+    big += std::to_string(i) + "\n";
+  std::atomic<size_t> sunk{0};
+  subprocess::subprocess counter = sink([&](std::string_view piece) {
+    sunk += piece.size();
+    return true;
+  });
+  // A slow reader fills its pipe, a head() stops reading, the others still get everything
+  subprocess::subprocess slow = exec("sh", "-c", "sleep 0.1; dd bs=5000 status=none | wc -l | grep -qx 100001");
+  ASSERT_TRUE(!env.run(memory(big) | fanout({open(${"tmpfile"}, File::Write), slow, counter, head(1)}) | read("out")));
+  ASSERT_EQ(big.size() + 1, sunk);
+  ASSERT_TRUE(big == ${"out"}.get(env));
+  ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+  ASSERT_TRUE(big == ${"file"}.get(env));
+  ASSERT_TRUE(!env.run(exec("rm", ${"tmpfile"})));
+
+  // Without a stdout the last output takes its place
+  sunk = 0;
+  ASSERT_TRUE(!env.run(echo("x") | fanout({counter})));
+  ASSERT_EQ(2u, sunk);
+  // Outputs can set variables
+  ASSERT_TRUE(!env.run(echo("x") | fanout({read("f1"), exec("tr", "x", "y") | read("f2")})));
+  ASSERT_STREQ("x", ${"f1"}.get(env).c_str());
+  ASSERT_STREQ("y", ${"f2"}.get(env).c_str());
+}
+
+TEST(SubprocessTest, Cached) {
+  Environment env{};
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("log")));
+  ASSERT_TRUE(!env.run(echo("a") | read("arg")));
+  // Every run leaves a line in the log
+  subprocess::subprocess runs = (exec("wc", "-l") < ${"log"}) | read("runs");
+  subprocess::subprocess counted =
+      cached(exec("sh", "-c", "echo run >> \"$0\"; echo \"$1\"; exit 3", ${"log"}, ${"arg"}), std::chrono::minutes(1));
+
+  // The output and return code are replayed, also without a stdout and in copies of the tree
+  ASSERT_EQ(3, env.run(counted | read("out")));
+  ASSERT_STREQ("a", ${"out"}.get(env).c_str());
+  ASSERT_EQ(3, env.run(counted | read("out")));
+  ASSERT_STREQ("a", ${"out"}.get(env).c_str());
+  ASSERT_EQ(3, env.run(counted));
+  ASSERT_EQ(3, env.run(counted->copy() | read("out")));
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("1", ${"runs"}.get(env).c_str());
+
+  // Another value of a variable it reads is another entry
+  ASSERT_TRUE(!env.run(echo("b") | read("arg")));
+  ASSERT_EQ(3, env.run(counted | read("out")));
+  ASSERT_STREQ("b", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("a") | read("arg")));
+  ASSERT_EQ(3, env.run(counted | read("out")));
+  ASSERT_STREQ("a", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("2", ${"runs"}.get(env).c_str());
+
+  // So is a change of the exported variables the child sees
+  ASSERT_TRUE(!env.run(echo("/bin:/usr/bin") | read("PATH")));
+  ASSERT_EQ(3, env.run(counted));
+  ASSERT_EQ(3, env.run(counted));
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("3", ${"runs"}.get(env).c_str());
+
+  // Or of the modification time of a file
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("input")));
+  string input = ${"input"}.get(env);
+  subprocess::subprocess file = cached(exec("cat", input), std::chrono::minutes(1), {input});
+  ASSERT_TRUE(!env.run(echo("first") > input));
+  ASSERT_TRUE(!env.run(file | read("out")));
+  ASSERT_TRUE(!env.run(echo("second") > input));
+  ASSERT_TRUE(!env.run(file | read("out")));
+  ASSERT_STREQ("second", ${"out"}.get(env).c_str());
+
+  // An entry lasts for the ttl
+  subprocess::subprocess expiring =
+      cached(exec("sh", "-c", "echo run >> \"$0\"", ${"log"}), std::chrono::milliseconds(50));
+  ASSERT_TRUE(!env.run(expiring));
+  ASSERT_TRUE(!env.run(expiring));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_TRUE(!env.run(expiring));
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("5", ${"runs"}.get(env).c_str());
+
+  // The output a read() at its end captured is replayed into the variable on a hit
+  subprocess::subprocess captured = cached(
+      exec("sh", "-c", "echo run >> \"$0\"; echo \"$1\"", ${"log"}, ${"arg"}) | read("out"), std::chrono::minutes(1));
+  ASSERT_TRUE(!env.run(echo("c") | read("arg")));
+  ASSERT_TRUE(!env.run(captured));
+  ASSERT_STREQ("c", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(echo("") | read("out")));
+  ASSERT_TRUE(!env.run(captured));
+  ASSERT_STREQ("c", ${"out"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("6", ${"runs"}.get(env).c_str());
+  // Which a const Environment can't take
+  const Environment &fixed = env;
+  ASSERT_THROW(fixed.run(captured), std::invalid_argument);
+
+  // A run killed by a signal, or cut short by a timeout, isn't replayed
+  subprocess::subprocess killed =
+      cached(exec("sh", "-c", "echo run >> \"$0\"; kill -9 $$", ${"log"}), std::chrono::minutes(1));
+  ASSERT_EQ(SIGKILL, env.run(killed));
+  ASSERT_EQ(SIGKILL, env.run(killed));
+  subprocess::subprocess slow =
+      cached(exec("sh", "-c", "echo run >> \"$0\"; exec sleep 5", ${"log"}), std::chrono::minutes(1));
+  for (int i = 0; i < 2; i++) {
+    Cancellation timeout{std::chrono::milliseconds(100)};
+    ASSERT_EQ(SIGKILL, run(slow, env, timeout));
+  }
+  ASSERT_TRUE(!env.run(runs));
+  ASSERT_STREQ("10", ${"runs"}.get(env).c_str());
+
+  // Nor is a run in another directory
+  subprocess::subprocess where = cached(exec("pwd"), std::chrono::minutes(1));
+  char cwd[4096];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)));
+  ASSERT_TRUE(!env.run(where | read("out")));
+  ASSERT_EQ(0, chdir("/"));
+  ASSERT_TRUE(!env.run(where | read("root")));
+  ASSERT_EQ(0, chdir(cwd));
+  ASSERT_EQ(cwd, ${"out"}.get(env));
+  ASSERT_STREQ("/", ${"root"}.get(env).c_str());
+  ASSERT_TRUE(!env.run(exec("rm", ${"log"}, input)));
+
+  // A cached subprocess reads no stdin
+  ASSERT_THROW(env.run(echo("x") | cached(exec("cat"), std::chrono::minutes(1))), std::invalid_argument);
+}
+
+// Counts the builtins that needed a task
+struct CountingExecutor : public Executor {
+  std::atomic<int> tasks{0};
+  void execute(std::function<void()> &&task) override {
+    tasks++;
+    Executor::Threads.execute(std::move(task));
+  }
+};
+
+TEST(SubprocessTest, PipeElision) {
+  CountingExecutor counting{};
+  Environment env{};
+  env.set_executor(counting);
+
+  // Known outputs are handed over in memory, through any number of filters
+  ASSERT_TRUE(!env.run(echo("a\nbb\nab") | read("x")));
+  ASSERT_TRUE(!env.run(echo(${"x"}) | grep("a") | wc(Filter::Lines | Filter::Bytes) | read("count")));
+  ASSERT_TRUE(!env.run(read("copy") << ${"x"}));
+  ASSERT_EQ(0, counting.tasks);
+  ASSERT_STREQ("2 5", ${"count"}.get(env).c_str());
+  ASSERT_STREQ("a\nbb\nab", ${"copy"}.get(env).c_str());
+
+  // A process gets the output from a single writer, or a memfd, and its stages run once
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("tmpfile")));
+  ASSERT_TRUE(!env.run(echo(${"x"}) | tee(${"tmpfile"}, true) | exec("cat") | head(1) | read("first")));
+  ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+  ASSERT_TRUE(!env.run(exec("rm", ${"tmpfile"})));
+  ASSERT_STREQ("a", ${"first"}.get(env).c_str());
+  ASSERT_STREQ("a\nbb\nab", ${"file"}.get(env).c_str());
+
+  // Explicit pipe settings keep the kernel pipe
+  counting.tasks = 0;
+  ASSERT_TRUE(!env.run(pipe(echo("piped"), read("x"), {.capacity = 1 << 16})));
+  ASSERT_STREQ("piped", ${"x"}.get(env).c_str());
+  ASSERT_EQ(2, counting.tasks);
+  // As do those of the environment
+  counting.tasks = 0;
+  Environment packets = env;
+  packets.set_pipe_options({.packet = true});
+  ASSERT_TRUE(!packets.run(echo("piped") | read("x")));
+  ASSERT_EQ(2, counting.tasks);
+
+  // tee writes its file, so it runs as a stage of its own
+  counting.tasks = 0;
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("tmpfile")));
+  ASSERT_TRUE(!env.run(echo(${"x"}) | tee(${"tmpfile"}) | read("teed")));
+  ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+  ASSERT_TRUE(!env.run(exec("rm", ${"tmpfile"})));
+  ASSERT_STREQ("piped", ${"teed"}.get(env).c_str());
+  ASSERT_STREQ("piped", ${"file"}.get(env).c_str());
+  ASSERT_LT(0, counting.tasks);
+}
+
+TEST(SubprocessTest, InlineAndOr) {
+  CountingExecutor counting{};
+  Environment env{};
+  env.set_executor(counting);
+
+  // run() evaluates && and || on the calling thread, still short-circuiting
+  ASSERT_EQ(0, env.run((exec("true") && exec("false")) || exec("true")));
+  ASSERT_EQ(1, env.run(exec("true") && (exec("false") || exec("sh", "-c", "exit 3"))));
+  ASSERT_EQ(0, env.run((false_ && exec("false")) || (echo("x") | read("x") && true_)));
+  ASSERT_EQ(0, env.run(true_ || read("never") << "y"));
+  ASSERT_EQ(0, counting.tasks);
+  ASSERT_STREQ("x", ${"x"}.get(env).c_str());
+
+  // Started in the background they still get a RunThread, so the caller can go on
+  runsubprocess running = (exec("true") && exec("sh", "-c", "exit 3"))->start({}, env);
+  ASSERT_EQ(1, running->wait());
+  ASSERT_EQ(1, counting.tasks);
+
+  // The stats tree of the inline path has the same shape as the threaded one
+  struct Collect : Tracer {
+    Stats last{};
+    void trace(const Stats &stats) override { last = stats; }
+  } collect;
+  env.set_tracer(collect);
+  ASSERT_EQ(1, env.run(exec("false") || exec("false")));
+  ASSERT_STREQ("||", collect.last.name.c_str());
+  ASSERT_EQ(2, collect.last.children.size());
+  ASSERT_EQ(1, collect.last.ret);
+}
+
+TEST(SubprocessTest, Memory) {
+  Environment env{};
+  ASSERT_TRUE(!env.run((exec("sort") << "b\na") | read("sorted")));
+  ASSERT_STREQ("a\nb", ${"sorted"}.get(env).c_str());
+
+  // The child gets a regular file instead of a pipe
+  ASSERT_EQ(0, env.run(exec("test", "-f", "/dev/stdin") << "x"));
+
+  string big(1 << 24, 'm');
+  ASSERT_TRUE(!env.run(echo(big) | read("big")));
+  ASSERT_TRUE(!env.run((exec("wc", "-c") << ${"big"}) | read("count")));
+  ASSERT_EQ(std::to_string(big.size() + 1), ${"count"}.get(env));
+  ASSERT_TRUE(!env.run(memory(${"big"}) | read("copy")));
+  ASSERT_EQ(big, ${"copy"}.get(env));
+
+  Variables uses;
+  memory(${"big"})->get_variables(uses);
+  ASSERT_EQ(std::vector<string>{"big"}, uses.reads);
+}
+
+TEST(SubprocessTest, Fixed) {
+  Environment env{};
+  auto pipeline = fixed::text<"b", "a"> | fixed::cmd<"tr", " ", "\\n"> |
+                  fixed::cmd<"sort"> | fixed::read<"sorted">;
+  static_assert(std::is_empty_v<decltype(pipeline)>);
+  ASSERT_EQ(0, env.run(pipeline));
+  ASSERT_STREQ("a\nb", ${"sorted"}.get(env).c_str());
+
+  // The tree is built once and shared by every use of the same expression
+  subprocess::subprocess first = pipeline;
+  subprocess::subprocess second = fixed::text<"b", "a"> | fixed::cmd<"tr", " ", "\\n"> |
+                                  fixed::cmd<"sort"> | fixed::read<"sorted">;
+  ASSERT_EQ(first.get(), second.get());
+
+  ASSERT_EQ(0, run(fixed::false_ || fixed::cmd<"true">));
+  ASSERT_NE(0, run(fixed::true_ && fixed::cmd<"false">));
+
+  // Mixes with runtime subprocesses
+  ASSERT_EQ(0, env.run(fixed::cmd<"echo", "mixed"> | read("out")));
+  ASSERT_STREQ("mixed", ${"out"}.get(env).c_str());
+}
+
+TEST(SubprocessTest, Interpolation) {
+  Environment env{};
+  ASSERT_TRUE(!env.run(echo("world") | read("who")));
+  ASSERT_TRUE(!env.run(echo("hello ") | read("greeting")));
+  ASSERT_TRUE(!env.run(
+      exec("echo", "[" + ${"greeting"} + ${"who"} + "]", ${"who"} + "!") |
+      read("out")));
+  ASSERT_STREQ("[hello world] world!", ${"out"}.get(env).c_str());
+
+  Variables uses;
+  echo(${"greeting"} + "-" + ${"who"})->get_variables(uses);
+  ASSERT_EQ((std::vector<string>{"greeting", "who"}), uses.reads);
+
+  // A started echo keeps writing the value it started with
+  string old(1 << 20, 'o');
+  ASSERT_TRUE(!env.run(echo(old) | read("big")));
+  runsubprocess running = echo("<" + ${"big"} + ">")->start({.out = Streams::New}, env);
+  ASSERT_TRUE(!env.run(echo("new") | read("big")));
+  int fd = running->get_streams().out;
+  string got;
+  char buf[1 << 16];
+  for (ssize_t count; (count = ::read(fd, buf, sizeof(buf))) > 0;)
+    got.append(buf, count);
+  close(fd);
+  ASSERT_EQ(0, running->wait());
+  ASSERT_EQ("<" + old + ">\n", got);
+  ASSERT_STREQ("new", ${"big"}.get(env).c_str());
+
+  ASSERT_TRUE(!env.run(memory("(" + ${"who"} + ")") | read("out")));
+  ASSERT_STREQ("(world)", ${"out"}.get(env).c_str());
+}
+
+TEST(SubprocessTest, FileToFile) {
+  Environment env{};
+  string text(1 << 20, 'x');
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("src")));
+  ASSERT_TRUE(!env.run(exec("mktemp") | read("dst")));
+  ASSERT_TRUE(!env.run(echo(text) > ${"src"}));
+  ASSERT_TRUE(!env.run(open(${"src"}, File::Read) > ${"dst"}));
+  ASSERT_TRUE(!env.run(open(${"src"}, File::Read) >> ${"dst"}));
+  ASSERT_TRUE(!env.run(read("out") < ${"dst"}));
+  ASSERT_TRUE(!env.run(exec("rm", ${"src"}, ${"dst"})));
+  ASSERT_EQ(text + "\n" + text, ${"out"}.get(env));
+}
+
+TEST(SubprocessTest, Executors) {
+  ThreadPool pool{2};
+  EventLoop loop{2};
+  Uring uring{2};
+  for (Executor *executor : {&Executor::Threads, static_cast<Executor *>(&pool),
+                             static_cast<Executor *>(&loop), static_cast<Executor *>(&uring)}) {
+    Environment env{};
+    env.set_executor(*executor);
+    string big(1 << 20, 'b');
+
+    ASSERT_TRUE(!env.run(echo(big) | exec("cat") | read("big")));
+    ASSERT_EQ(big, ${"big"}.get(env));
+
+    ASSERT_TRUE(!env.run(exec("mktemp") | read("tmpfile")));
+    ASSERT_TRUE(!env.run(echo(big) > ${"tmpfile"}));
+    ASSERT_TRUE(!env.run(read("file") < ${"tmpfile"}));
+    ASSERT_TRUE(!env.run(exec("rm", ${"tmpfile"})));
+    ASSERT_EQ(big, ${"file"}.get(env));
+
+    subprocess::subprocess chain = echo("0") | read("step");
+    for (int i = 1; i < 50; i++)
+      chain = chain && (echo(std::to_string(i)) | read("step"));
+    ASSERT_TRUE(!env.run(chain || false_));
+    ASSERT_STREQ("49", ${"step"}.get(env).c_str());
+  }
+}
+
+TEST(SubprocessTest, Uring) {
+  // Hundreds of pipelines at once, their reads and exits all go through one ring
+  Uring uring{2, 16};
+  Environment env{};
+  env.set_executor(uring);
+  JobSet jobs{uring};
+  std::vector<Environment> envs(200, env);
+  for (size_t i = 0; i < envs.size(); i++)
+    jobs.add(spawn(echo(std::to_string(i)) | exec("cat") | read("out"), envs[i]));
+  ASSERT_EQ(0, jobs.wait_all());
+  for (size_t i = 0; i < envs.size(); i++)
+    ASSERT_EQ(std::to_string(i), ${"out"}.get(envs[i]));
+
+  // Far more polls outstanding at once than the completion queue holds
+  Uring small{2, 4};
+  env.set_executor(small);
+  JobSet waits{small};
+  for (size_t i = 0; i < envs.size(); i++)
+    waits.add(spawn(exec("sh", "-c", "sleep 0.2; echo " + std::to_string(i)) | read("out"), envs[i] = env));
+  ASSERT_EQ(0, waits.wait_all());
+  for (size_t i = 0; i < envs.size(); i++)
+    ASSERT_EQ(std::to_string(i), ${"out"}.get(envs[i]));
+
+  // Pipelines whose stages wait on each other, with more watches than completion entries
+  string big(1 << 20, 'b');
+  for (auto [entries, count] : {std::pair{1u, 1ul}, std::pair{4u, 50ul}}) {
+    Uring tiny{2, entries};
+    env.set_executor(tiny);
+    JobSet copies{tiny};
+    for (size_t i = 0; i < count; i++)
+      copies.add(spawn(echo(big) | exec("cat") | read("out"), envs[i] = env));
+    ASSERT_EQ(0, copies.wait_all());
+    for (size_t i = 0; i < count; i++)
+      ASSERT_EQ(big, ${"out"}.get(envs[i]));
+  }
+}
+
+// Starts eagerly and destroys itself once finished
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static Detached supervise(Executor &executor, const subprocess::subprocess &sub,
+                          std::promise<int> &result) {
+  runsubprocess running = sub->start();
+  result.set_value(co_await running->async_wait(executor));
+}
+
+static Detached capture(Executor &executor, const subprocess::subprocess &sub,
+                        std::promise<string> &result) {
+  runsubprocess running = sub->start({.out = Streams::New});
+  int fd = running->get_streams().out;
+  string out{};
+  for (string chunk; !(chunk = co_await async_read(executor, fd)).empty();)
+    out += chunk;
+  close(fd);
+  co_await running->async_wait(executor);
+  result.set_value(out);
+}
+
+TEST(SubprocessTest, AsyncWait) {
+  // The subprocesses have to outlive their runs
+  EventLoop loop{};
+  const size_t count = 100;
+  subprocess::subprocess success = exec("true");
+  subprocess::subprocess failure = exec("false") | exec("true");
+  std::vector<std::promise<int>> results(count);
+  for (size_t i = 0; i < count; i++)
+    supervise(loop, i % 2 ? success : failure, results[i]);
+  for (size_t i = 0; i < count; i++)
+    ASSERT_EQ(i % 2 ? 0 : 1, results[i].get_future().get());
+
+  subprocess::subprocess builtins = echo("x") | (exec("cat") > dev::null) && false_;
+  std::promise<int> builtins_result;
+  supervise(loop, builtins, builtins_result);
+  ASSERT_EQ(1, builtins_result.get_future().get());
+
+  subprocess::subprocess reversed = exec("echo", "async") | exec("rev");
+  std::promise<string> output;
+  capture(loop, reversed, output);
+  ASSERT_EQ("cnysa\n", output.get_future().get());
+}
+
+TEST(SubprocessTest, SharedTree) {
+  // Composition shares the operands, so a deep tree is cheap to build
+  subprocess::subprocess chain = true_;
+  for (int i = 0; i < 10000; i++)
+    chain = chain && true_;
+
+  subprocess::subprocess pipe = echo("shared");
+  for (int i = 0; i < 20; i++)
+    pipe = pipe | exec("cat");
+  subprocess::subprocess tail = exec("rev");
+
+  std::vector<std::thread> threads;
+  std::vector<Environment> envs(4);
+  for (auto &env : envs)
+    threads.emplace_back(
+        [&env, sub = pipe | tail | read("out")] { env.run(sub); });
+  for (auto &thread : threads)
+    thread.join();
+  for (auto &env : envs)
+    ASSERT_STREQ("derahs", ${"out"}.get(env).c_str());
+}
+
+// Counts the allocations passed on to the default resource
+class CountingResource : public std::pmr::memory_resource {
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations++;
+    return std::pmr::get_default_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+public:
+  size_t allocations = 0;
+};
+
+TEST(SubprocessTest, RunArena) {
+  CountingResource upstream{};
+  subprocess::subprocess small = exec("true") | exec("cat") | read("x");
+  subprocess::subprocess large = exec("true");
+  for (int i = 0; i < 50; i++)
+    large = large | exec("cat");
+
+  Environment env{};
+  {
+    RunArena arena{&upstream};
+    ASSERT_EQ(0, small->start({}, env)->wait());
+  }
+  ASSERT_EQ(0u, upstream.allocations);
+
+  {
+    RunArena arena{&upstream};
+    ASSERT_EQ(0, large->start({}, env)->wait());
+  }
+  ASSERT_GT(upstream.allocations, 0u);
+  ASSERT_LT(upstream.allocations, 10u);
+}
+
+TEST(SubprocessTest, PipeOptions) {
+  Environment env{};
+  env.set_pipe_options({.capacity = 1 << 20});
+  runsubprocess running = exec("true")->start({.out = Streams::New}, env);
+  int fd = running->get_streams().out;
+  ASSERT_EQ(1 << 20, fcntl(fd, F_GETPIPE_SZ));
+  close(fd);
+  ASSERT_EQ(0, running->wait());
+
+  string big(1 << 22, 'p');
+  ASSERT_TRUE(!env.run(echo(big) | exec("cat") | read("out")));
+  ASSERT_EQ(big, ${"out"}.get(env));
+
+  // A pipe of its own, packets still add up to the same output
+  ASSERT_TRUE(!env.run(pipe(echo(big), exec("cat"), {.packet = true}) |
+                       read("out")));
+  ASSERT_EQ(big, ${"out"}.get(env));
+  ASSERT_TRUE(!env.run(pipe(exec("echo", "own"), read("out"),
+                            {.capacity = 1 << 16, .packet = true})));
+  ASSERT_STREQ("own", ${"out"}.get(env).c_str());
+
+  // Packets not dividing the buffers are read whole, none loses its end
+  subprocess::subprocess packets =
+      exec("sh", "-c", "yes 123456789 | head -c 300000 | dd bs=3000 iflag=fullblock status=none");
+  ASSERT_TRUE(!env.run(pipe(packets, read("out"), {.packet = true})));
+  ASSERT_EQ(299999u, ${"out"}.get(env).size()); // Without the last newline
+  size_t bytes = 0, pieces = 0;
+  ASSERT_TRUE(!env.run(pipe(packets, sink([&](std::string_view piece) {
+    bytes += piece.size();
+    return piece.size() <= 100;
+  }, 100), {.packet = true})));
+  ASSERT_EQ(300000u, bytes);
+  bytes = 0;
+  ASSERT_TRUE(!env.run(pipe(packets, lines([&](std::string_view line) {
+    bytes += line.size() + 1;
+    pieces += line == "123456789";
+    return true;
+  }, 5000), {.packet = true})));
+  ASSERT_EQ(300000u, bytes);
+  ASSERT_EQ(30000u, pieces);
+
+  // A side failing to start doesn't leave the pipe made for both open
+  Zygote zygote{};
+  Environment launched{};
+  launched.set_launcher(zygote);
+  int next = dup(0);
+  close(next);
+  ASSERT_THROW(launched.run(pipe(exec("true", string(4 << 20, 'a')), read("out"), {.capacity = 1 << 16})),
+               std::system_error);
+  int after = dup(0);
+  close(after);
+  ASSERT_EQ(next, after);
+}
+
+class Recorder : public Tracer {
+ public:
+  void trace(const Stats &stats) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    traces.push_back(stats);
+  }
+  std::mutex mutex;
+  std::vector<Stats> traces;
+};
+
+TEST(SubprocessTest, Tracer) {
+  Recorder recorder;
+  Environment env{};
+  env.set_tracer(recorder);
+  ASSERT_TRUE(!env.run((echo("abc") | exec("cat") | read("x")) && exec("true")));
+  ASSERT_STREQ("abc", ${"x"}.get(env).c_str());
+
+  ASSERT_EQ(1u, recorder.traces.size());
+  const Stats &root = recorder.traces[0];
+  ASSERT_EQ("&&", root.name);
+  ASSERT_EQ(0, root.ret);
+  ASSERT_EQ(2u, root.children.size());
+  ASSERT_EQ("exec true", root.children[1].name);
+
+  const Stats &pipeline = root.children[0];
+  ASSERT_EQ("|", pipeline.name);
+  std::vector<string> names;
+  std::function<void(const Stats &)> walk = [&](const Stats &stats) {
+    if (stats.children.empty())
+      names.push_back(stats.name);
+    for (const Stats &child : stats.children)
+      walk(child);
+  };
+  walk(pipeline);
+  ASSERT_EQ((std::vector<string>{"echo", "exec cat", "read x"}), names);
+  ASSERT_EQ(8u, pipeline.bytes);  // Written by echo, then read back
+  ASSERT_GT(pipeline.max_rss, 0);
+  ASSERT_GE(root.wall, pipeline.wall);
+
+  // Without a tracer nothing is collected for the parts
+  Environment quiet{};
+  runsubprocess running = (exec("true") && exec("true"))->start({}, quiet);
+  ASSERT_EQ(0, running->wait());
+  ASSERT_TRUE(running->stats().children.empty());
+}